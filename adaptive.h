@@ -0,0 +1,114 @@
+#ifndef ADAPTIVE_H
+#define ADAPTIVE_H
+
+// ピクセルごとに輝度の平均と分散を数えながらサンプルを足し、
+// 平均の標準誤差が CONFIG.noise (平均に対する割合) を下回ったらそのピクセルは打ち切る。
+// 背景しか見えないピクセルは分散が 0 なので CONFIG.min_samples で止まる。
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <math.h>
+#include "config.h"
+#include "vec3.h"
+
+// relative error is measured against at least this luminance, so dark pixels can stop too
+#define ADAPTIVE_MIN_LUMINANCE REAL(0.01)
+
+// running luminance statistics of one pixel (Welford)
+typedef struct
+{
+    int samples;
+    real mean;
+    real m2; // sum of squared differences from the mean
+} pixel_variance;
+
+typedef struct
+{
+    bool enabled;
+    int width, height;
+    pixel_variance *pixels; // same layout as framebuffer
+} adaptive_sampler;
+
+static adaptive_sampler ADAPTIVE;
+
+void adaptive_init(int width, int height, bool enabled)
+{
+    ADAPTIVE.enabled = enabled;
+    ADAPTIVE.width = width;
+    ADAPTIVE.height = height;
+    ADAPTIVE.pixels = NULL;
+    if (!enabled)
+        return;
+    ADAPTIVE.pixels = calloc((size_t)width * height, sizeof(pixel_variance));
+    if (!ADAPTIVE.pixels)
+    {
+        perror("adaptive_init");
+        exit(1);
+    }
+}
+
+void adaptive_free(void)
+{
+    free(ADAPTIVE.pixels);
+    ADAPTIVE.pixels = NULL;
+}
+
+static inline pixel_variance *adaptive_at(int x, int row)
+{
+    return &ADAPTIVE.pixels[(size_t)row * ADAPTIVE.width + x];
+}
+
+static inline real luminance(color c)
+{
+    return REAL(0.2126) * c.x + REAL(0.7152) * c.y + REAL(0.0722) * c.z;
+}
+
+static inline void adaptive_add(int x, int row, color c)
+{
+    if (!ADAPTIVE.enabled)
+        return;
+    pixel_variance *p = adaptive_at(x, row);
+    real l = luminance(c);
+    p->samples++;
+    real d = l - p->mean;
+    p->mean += d / p->samples;
+    p->m2 += d * (l - p->mean);
+}
+
+// true when the pixel needs no more samples
+static inline bool adaptive_done(int x, int row)
+{
+    if (!ADAPTIVE.enabled)
+        return false;
+    const pixel_variance *p = adaptive_at(x, row);
+    if (p->samples < CONFIG.min_samples || p->samples < 2)
+        return false;
+    // standard error of the mean, squared
+    real error2 = p->m2 / ((real)(p->samples - 1) * p->samples);
+    real limit = (real)CONFIG.noise * (p->mean > ADAPTIVE_MIN_LUMINANCE ? p->mean : ADAPTIVE_MIN_LUMINANCE);
+    return error2 <= limit * limit;
+}
+
+// samples taken by a pixel, every pixel has samples_done without adaptive sampling
+static inline int adaptive_samples(int x, int row, int samples_done)
+{
+    return ADAPTIVE.enabled ? adaptive_at(x, row)->samples : samples_done;
+}
+
+void adaptive_report(int samples_done)
+{
+    size_t pixels = (size_t)ADAPTIVE.width * ADAPTIVE.height;
+    unsigned long long total = 0;
+    for (int row = 0; row < ADAPTIVE.height; ++row)
+        for (int x = 0; x < ADAPTIVE.width; ++x)
+        {
+            total += adaptive_samples(x, row, samples_done);
+        }
+    double budget = (double)pixels * samples_done;
+    printf("samples %llu, %f per pixel, %f%% of %d per pixel\n",
+           total, pixels > 0 ? (double)total / pixels : 0.0,
+           budget > 0.0 ? 100.0 * total / budget : 0.0, samples_done);
+}
+
+#endif
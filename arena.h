@@ -0,0 +1,66 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+// 小さなオブジェクトを詰めて置くための領域。ブロックを確保して前から順に切り出し、
+// 足りなくなったら倍の大きさのブロックを足す。ブロックは動かないのでポインタはずっと有効で、
+// 個別には解放せず arena_free でまとめて返す。
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+
+#define ARENA_FIRST_BLOCK 4096 // bytes
+
+typedef struct arena_block
+{
+    struct arena_block *prev;
+    size_t size, used;
+    max_align_t data[]; // size bytes
+} arena_block;
+
+typedef struct
+{
+    arena_block *last; // blocks are chained from the newest
+} arena;
+
+// size bytes aligned to align (a power of two no larger than max_align_t), never NULL
+void *arena_alloc(arena *a, size_t size, size_t align)
+{
+    arena_block *b = a->last;
+    size_t offset = b ? (b->used + align - 1) & ~(align - 1) : 0;
+    if (!b || offset + size > b->size)
+    {
+        size_t block_size = b ? 2 * b->size : ARENA_FIRST_BLOCK;
+        while (block_size < size)
+            block_size *= 2;
+        arena_block *nb = malloc(sizeof(arena_block) + block_size);
+        if (!nb)
+        {
+            perror("arena");
+            exit(1);
+        }
+        nb->prev = b;
+        nb->size = block_size;
+        nb->used = 0;
+        a->last = b = nb;
+        offset = 0;
+    }
+    b->used = offset + size;
+    return (char *)b->data + offset;
+}
+
+#define ARENA_NEW(a, type) ((type *)arena_alloc((a), sizeof(type), _Alignof(type)))
+
+void arena_free(arena *a)
+{
+    arena_block *b = a->last;
+    while (b)
+    {
+        arena_block *prev = b->prev;
+        free(b);
+        b = prev;
+    }
+    a->last = NULL;
+}
+
+#endif
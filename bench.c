@@ -0,0 +1,270 @@
+// レンダラーの比較用ベンチマーク。
+// 各プログラムを各シーンとスレッド数で runs 回ずつ走らせ、描画時間と Mrays/sec の
+// 最小・中央値・最大、深さごとの ray 数を表にして表示し、CSV に追記する。
+//   bench [--runs N] [--threads 1,2,4] [--csv FILE] [--label TEXT] [--args "OPTIONS"] [--rays PROGRAM]
+//         [--rays_float PROGRAM] PROGRAM... -- SCENE...
+// スレッド数は OMP_NUM_THREADS で渡す。名前に "_omp" を含まないプログラムは 1 スレッドだけで走らせる。
+// 時間はプログラムの出力の "render done" から、ray 数は -DRT_STATS のビルドが出す "rays", "rays per depth" (stats.h) から読む。
+// 計測するビルドは数えないので、--rays の RT_STATS ビルドをシーンごとに 1 回走らせ、その ray 数で Mrays/sec を出す。
+// 乱数列は固定なので、同じ精度のビルドはシーンが同じなら同じ ray を飛ばす。float と double では経路が丸めで
+// 分かれるので、名前に "_float" を含むプログラムは --rays_float の float RT_STATS ビルドの数を使う。
+// 数えるビルドがなければ時間だけを表示する。
+
+#define _POSIX_C_SOURCE 200809L // popen
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#define BENCH_MAX_RUNS 1000
+#define BENCH_MAX_THREADS 64 // entries of --threads
+#define BENCH_LINE_LEN 8192
+
+typedef struct
+{
+    double sec;   // render time, setup not included
+    size_t rays;  // all rays traced by the render, 0 when the program does not count them
+    char depth[BENCH_LINE_LEN]; // rays per bounce, space separated
+} bench_run;
+
+static int compare_double(const void *a, const void *b)
+{
+    const double *da = a;
+    const double *db = b;
+    return (*da > *db) - (*da < *db);
+}
+
+// min, median and max of n values, values get sorted
+static void bench_spread(double *values, int n, double out[3])
+{
+    qsort(values, n, sizeof(double), compare_double);
+    out[0] = values[0];
+    out[1] = n % 2 ? values[n / 2] : 0.5 * (values[n / 2 - 1] + values[n / 2]);
+    out[2] = values[n - 1];
+}
+
+// run the program once and read its report, false when it fails
+static bool bench_once(const char *program, const char *scene, int threads, const char *args, bench_run *run)
+{
+    char command[BENCH_LINE_LEN];
+    // a program in the current directory needs the ./ to be found by the shell
+    const char *dir = strchr(program, '/') ? "" : "./";
+    snprintf(command, sizeof(command), "OMP_NUM_THREADS=%d %s%s --scene '%s' --output /dev/null --quiet 1 %s",
+             threads, dir, program, scene, args);
+
+    FILE *p = popen(command, "r");
+    if (!p)
+    {
+        perror(command);
+        return false;
+    }
+
+    bool have_sec = false;
+    run->rays = 0;
+    run->depth[0] = '\0';
+    char line[BENCH_LINE_LEN];
+    while (fgets(line, sizeof(line), p))
+    {
+        if (sscanf(line, "render done %lf sec", &run->sec) == 1)
+        {
+            have_sec = true;
+        }
+        else if (strncmp(line, "rays per depth", 14) == 0)
+        {
+            const char *s = line + 14;
+            while (*s == ' ')
+                ++s;
+            snprintf(run->depth, sizeof(run->depth), "%s", s);
+            run->depth[strcspn(run->depth, "\n")] = '\0';
+        }
+        else
+        {
+            sscanf(line, "rays %zu,", &run->rays);
+        }
+    }
+
+    int status = pclose(p);
+    if (status != 0 || !have_sec)
+    {
+        fprintf(stderr, "failed: %s\n", command);
+        return false;
+    }
+    return true;
+}
+
+// "1,2,4" to a list of thread counts
+static int parse_threads(const char *list, int *threads)
+{
+    int n = 0;
+    const char *s = list;
+    while (*s && n < BENCH_MAX_THREADS)
+    {
+        char *end;
+        long v = strtol(s, &end, 10);
+        if (end == s || v < 1 || v > 4096 || (*end != ',' && *end != '\0'))
+            return 0;
+        threads[n++] = v;
+        s = *end == ',' ? end + 1 : end;
+    }
+    return n;
+}
+
+// runs counter once on every scene, a NULL counter leaves counts at 0
+static int bench_count(const char *counter, char **scenes, int scene_num, const char *args, bench_run *counts)
+{
+    for (int s = 0; counter && s < scene_num; ++s)
+    {
+        if (!bench_once(counter, scenes[s], 1, args, &counts[s]) || counts[s].rays == 0)
+        {
+            fprintf(stderr, "%s counted no rays, is it built with -DRT_STATS?\n", counter);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [--runs N] [--threads 1,2,4] [--csv FILE] [--label TEXT] [--args \"OPTIONS\"] "
+                    "[--rays PROGRAM] [--rays_float PROGRAM] PROGRAM... -- SCENE...\n"
+                    "  --rays: RT_STATS build that counts the rays of the double programs\n"
+                    "  --rays_float: the same for the programs named *_float*, float paths differ from double ones\n",
+            prog);
+}
+
+int main(int argc, char *argv[])
+{
+    int runs = 5;
+    int threads[BENCH_MAX_THREADS] = {1};
+    int thread_num = 1;
+    const char *csv_name = NULL;
+    const char *label = "";
+    const char *args = "";
+    const char *counter = NULL;
+    const char *counter_float = NULL;
+
+    int i = 1;
+    for (; i + 1 < argc && strncmp(argv[i], "--", 2) == 0 && argv[i][2] != '\0'; i += 2)
+    {
+        if (strcmp(argv[i], "--runs") == 0)
+            runs = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "--threads") == 0)
+            thread_num = parse_threads(argv[i + 1], threads);
+        else if (strcmp(argv[i], "--csv") == 0)
+            csv_name = argv[i + 1];
+        else if (strcmp(argv[i], "--label") == 0)
+            label = argv[i + 1];
+        else if (strcmp(argv[i], "--args") == 0)
+            args = argv[i + 1];
+        else if (strcmp(argv[i], "--rays") == 0)
+            counter = argv[i + 1];
+        else if (strcmp(argv[i], "--rays_float") == 0)
+            counter_float = argv[i + 1];
+        else
+            break;
+    }
+
+    // programs, then "--", then scenes
+    char **programs = argv + i;
+    int program_num = 0;
+    while (i < argc && strcmp(argv[i], "--") != 0)
+    {
+        ++program_num;
+        ++i;
+    }
+    char **scenes = argv + i + 1;
+    int scene_num = i < argc ? argc - i - 1 : 0;
+
+    if (runs < 1 || runs > BENCH_MAX_RUNS || thread_num == 0 || program_num == 0 || scene_num == 0)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    FILE *csv = NULL;
+    if (csv_name)
+    {
+        csv = fopen(csv_name, "a");
+        if (!csv)
+        {
+            perror(csv_name);
+            return 1;
+        }
+        // the header goes only into a new file, so results of several builds pile up in one table
+        if (ftell(csv) == 0)
+            fprintf(csv, "label,program,scene,threads,runs,rays,sec_min,sec_median,sec_max,"
+                         "mrays_min,mrays_median,mrays_max,rays_per_depth\n");
+    }
+
+    // rays of every scene from the counting builds, one per precision
+    bench_run *count = calloc(scene_num, sizeof(bench_run));
+    bench_run *count_float = calloc(scene_num, sizeof(bench_run));
+    if (!bench_count(counter, scenes, scene_num, args, count) ||
+        !bench_count(counter_float, scenes, scene_num, args, count_float))
+        return 1;
+
+    printf("%-36s %-16s %7s %10s %10s %10s %9s %9s %9s\n", "program", "scene", "threads",
+           "sec min", "median", "max", "Mrays/s", "median", "max");
+
+    bench_run *run = malloc(sizeof(bench_run) * runs);
+    double sec[BENCH_MAX_RUNS], mrays[BENCH_MAX_RUNS];
+    int status = 0;
+    for (int p = 0; p < program_num; ++p)
+    {
+        bool parallel = strstr(programs[p], "_omp") != NULL;
+        const bench_run *counted = strstr(programs[p], "_float") != NULL ? count_float : count;
+        for (int s = 0; s < scene_num; ++s)
+        {
+            for (int t = 0; t < (parallel ? thread_num : 1); ++t)
+            {
+                int thread = parallel ? threads[t] : 1;
+                bool ok = true;
+                for (int r = 0; r < runs && ok; ++r)
+                {
+                    ok = bench_once(programs[p], scenes[s], thread, args, &run[r]);
+                    if (ok)
+                    {
+                        // a stats build counts its own rays
+                        if (run[r].rays == 0)
+                        {
+                            run[r].rays = counted[s].rays;
+                            memcpy(run[r].depth, counted[s].depth, sizeof(run[r].depth));
+                        }
+                        sec[r] = run[r].sec;
+                        mrays[r] = run[r].sec > 0.0 ? run[r].rays / run[r].sec * 1e-6 : 0.0;
+                    }
+                }
+                if (!ok)
+                {
+                    status = 1;
+                    continue;
+                }
+
+                // the random streams are fixed, so every run traces the same rays as the counter of its precision
+                double sec_spread[3], mrays_spread[3];
+                bench_spread(sec, runs, sec_spread);
+                bench_spread(mrays, runs, mrays_spread);
+
+                printf("%-36s %-16s %7d %10.4f %10.4f %10.4f %9.3f %9.3f %9.3f\n", programs[p], scenes[s], thread,
+                       sec_spread[0], sec_spread[1], sec_spread[2], mrays_spread[0], mrays_spread[1], mrays_spread[2]);
+                printf("    rays %zu, per depth %s\n", run[0].rays, run[0].depth);
+                fflush(stdout);
+                if (csv)
+                {
+                    fprintf(csv, "%s,%s,%s,%d,%d,%zu,%f,%f,%f,%f,%f,%f,%s\n", label, programs[p], scenes[s], thread,
+                            runs, run[0].rays, sec_spread[0], sec_spread[1], sec_spread[2],
+                            mrays_spread[0], mrays_spread[1], mrays_spread[2], run[0].depth);
+                    fflush(csv);
+                }
+            }
+        }
+    }
+
+    free(run);
+    free(count);
+    free(count_float);
+    if (csv)
+        fclose(csv);
+    return status;
+}
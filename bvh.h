@@ -0,0 +1,409 @@
+#ifndef BVH_H
+#define BVH_H
+
+// bounding volume hierarchy
+// aabb の配列から SAH で木を作る。木はノードの配列として平坦化して持つ。
+// 葉は連続したプリミティブの範囲を指すので、呼び出し側は index の順に
+// プリミティブを並べ替えてから使う。
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/time.h> // for time
+#include <stdbool.h>
+#include "vec3.h"
+#include "component.h"
+
+#define BVH_MAX_LEAF_SIZE 8
+#define BVH_BIN_NUM 16
+#define BVH_TRAVERSAL_COST 1.0
+#define BVH_INTERSECTION_COST 1.0
+#define BVH_TASK_THRESHOLD 4096 // ranges larger than this are built in their own OpenMP task
+#define BVH_MAX_SPLIT_DEPTH 64  // deeper nodes are split by count, which bounds the depth
+#define BVH_STACK_SIZE 128
+#define BVH_NO_HIT SIZE_MAX
+#define BVH_INNER_NODE UINT32_MAX // count of an inner node, a leaf may hold no primitive (the root of an empty tree)
+
+typedef struct
+{
+    aabb box;
+    uint32_t left_first; // inner node: index of left child (right child is left + 1), leaf: first primitive
+    uint32_t count;      // number of primitives, BVH_INNER_NODE for inner node
+} bvh_node;
+
+static inline bool bvh_is_leaf(const bvh_node *node)
+{
+    return node->count != BVH_INNER_NODE;
+}
+
+typedef struct
+{
+    double build_sec;
+    size_t node_num;
+    size_t leaf_num;
+    int depth;
+    double sah_cost; // expected cost of a random ray relative to the root box
+} bvh_stats;
+
+typedef struct
+{
+    bvh_node *nodes;
+    size_t node_num;
+    size_t *index; // index[i] is the original primitive placed at position i
+    size_t prim_num;
+    bvh_stats stats;
+} bvh;
+
+// ====== build ======
+// surface area heuristic with binned centroids.
+// large subtrees are built in parallel as OpenMP tasks.
+
+typedef struct
+{
+    aabb box;
+    size_t count;
+} bvh_bin;
+
+static int bvh_bin_of(double c, double min, double scale)
+{
+    int bin = (int)((c - min) * scale);
+    return bin < 0 ? 0 : bin >= BVH_BIN_NUM ? BVH_BIN_NUM - 1 : bin;
+}
+
+// find the cheapest split plane, return its cost or HUGE_VAL if no split exists
+static double bvh_find_split(const bvh *b, const aabb *bounds, const point *centroids,
+                             size_t first, size_t count, aabb centroid_box,
+                             int *best_axis, int *best_bin)
+{
+    double best_cost = HUGE_VAL;
+
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        double min = vec3_axis(centroid_box.min, axis);
+        double max = vec3_axis(centroid_box.max, axis);
+        if (max <= min)
+            continue;
+        double scale = BVH_BIN_NUM / (max - min);
+
+        bvh_bin bins[BVH_BIN_NUM];
+        for (int i = 0; i < BVH_BIN_NUM; ++i)
+        {
+            bins[i].box = aabb_empty();
+            bins[i].count = 0;
+        }
+        for (size_t i = first; i < first + count; ++i)
+        {
+            size_t p = b->index[i];
+            int bin = bvh_bin_of(vec3_axis(centroids[p], axis), min, scale);
+            bins[bin].box = aabb_union(bins[bin].box, bounds[p]);
+            bins[bin].count++;
+        }
+
+        // sweep from the right to get the area and count of every right side
+        double right_area[BVH_BIN_NUM];
+        size_t right_count[BVH_BIN_NUM];
+        aabb right_box = aabb_empty();
+        size_t right_sum = 0;
+        for (int i = BVH_BIN_NUM - 1; i > 0; --i)
+        {
+            right_box = aabb_union(right_box, bins[i].box);
+            right_sum += bins[i].count;
+            right_area[i] = aabb_surface_area(right_box);
+            right_count[i] = right_sum;
+        }
+
+        aabb left_box = aabb_empty();
+        size_t left_sum = 0;
+        for (int i = 0; i < BVH_BIN_NUM - 1; ++i)
+        {
+            left_box = aabb_union(left_box, bins[i].box);
+            left_sum += bins[i].count;
+            if (left_sum == 0 || right_count[i + 1] == 0)
+                continue;
+            double cost = (double)aabb_surface_area(left_box) * left_sum + right_area[i + 1] * right_count[i + 1];
+            if (cost < best_cost)
+            {
+                best_cost = cost;
+                *best_axis = axis;
+                *best_bin = i;
+            }
+        }
+    }
+
+    return best_cost;
+}
+
+static void bvh_build_node(bvh *b, const aabb *bounds, const point *centroids,
+                           size_t node_index, size_t first, size_t count, int depth)
+{
+    bvh_node *node = &b->nodes[node_index];
+
+    aabb box = aabb_empty();
+    aabb centroid_box = aabb_empty();
+    for (size_t i = first; i < first + count; ++i)
+    {
+        box = aabb_union(box, bounds[b->index[i]]);
+        centroid_box = aabb_extend(centroid_box, centroids[b->index[i]]);
+    }
+    node->box = box;
+
+    if (count <= 2)
+    {
+        node->left_first = first;
+        node->count = count;
+        return;
+    }
+
+    int axis = 0, bin = 0;
+    double split_cost = bvh_find_split(b, bounds, centroids, first, count, centroid_box, &axis, &bin);
+    double area = aabb_surface_area(box);
+    split_cost = area > 0.0 ? BVH_TRAVERSAL_COST + BVH_INTERSECTION_COST * split_cost / area : HUGE_VAL;
+    double leaf_cost = BVH_INTERSECTION_COST * count;
+
+    if (count <= BVH_MAX_LEAF_SIZE && leaf_cost <= split_cost)
+    {
+        node->left_first = first;
+        node->count = count;
+        return;
+    }
+
+    size_t left_count = 0;
+    if (split_cost < HUGE_VAL && depth < BVH_MAX_SPLIT_DEPTH)
+    {
+        double min = vec3_axis(centroid_box.min, axis);
+        double scale = BVH_BIN_NUM / ((double)vec3_axis(centroid_box.max, axis) - min);
+
+        size_t i = first;
+        size_t j = first + count;
+        while (i < j)
+        {
+            if (bvh_bin_of(vec3_axis(centroids[b->index[i]], axis), min, scale) <= bin)
+            {
+                ++i;
+            }
+            else
+            {
+                --j;
+                size_t tmp = b->index[i];
+                b->index[i] = b->index[j];
+                b->index[j] = tmp;
+            }
+        }
+        left_count = i - first;
+    }
+    if (left_count == 0 || left_count == count)
+    {
+        // no usable plane (identical centroids or the tree is too deep), split by count
+        left_count = count / 2;
+    }
+
+    size_t left;
+#pragma omp atomic capture
+    {
+        left = b->node_num;
+        b->node_num += 2;
+    }
+    node->left_first = left;
+    node->count = BVH_INNER_NODE;
+
+    if (count > BVH_TASK_THRESHOLD)
+    {
+#pragma omp task
+        bvh_build_node(b, bounds, centroids, left, first, left_count, depth + 1);
+#pragma omp task
+        bvh_build_node(b, bounds, centroids, left + 1, first + left_count, count - left_count, depth + 1);
+#pragma omp taskwait
+    }
+    else
+    {
+        bvh_build_node(b, bounds, centroids, left, first, left_count, depth + 1);
+        bvh_build_node(b, bounds, centroids, left + 1, first + left_count, count - left_count, depth + 1);
+    }
+}
+
+static void bvh_collect_stats(bvh *b, size_t node_index, int depth, double root_area)
+{
+    const bvh_node *node = &b->nodes[node_index];
+    double area = root_area > 0.0 ? (double)aabb_surface_area(node->box) / root_area : 0.0;
+
+    if (depth > b->stats.depth)
+        b->stats.depth = depth;
+
+    if (bvh_is_leaf(node))
+    {
+        b->stats.leaf_num++;
+        b->stats.sah_cost += area * BVH_INTERSECTION_COST * node->count;
+        return;
+    }
+    b->stats.sah_cost += area * BVH_TRAVERSAL_COST;
+    bvh_collect_stats(b, node->left_first, depth + 1, root_area);
+    bvh_collect_stats(b, node->left_first + 1, depth + 1, root_area);
+}
+
+void bvh_build(bvh *b, const aabb *bounds, size_t prim_num)
+{
+    struct timeval t1, t2;
+    gettimeofday(&t1, NULL);
+
+    b->prim_num = prim_num;
+    b->index = malloc(sizeof(size_t) * (prim_num > 0 ? prim_num : 1));
+    b->nodes = malloc(sizeof(bvh_node) * (prim_num > 0 ? 2 * prim_num - 1 : 1));
+    point *centroids = malloc(sizeof(point) * (prim_num > 0 ? prim_num : 1));
+
+#pragma omp parallel for
+    for (size_t i = 0; i < prim_num; ++i)
+    {
+        b->index[i] = i;
+        centroids[i] = aabb_centroid(bounds[i]);
+    }
+
+    b->node_num = 1;
+    if (prim_num == 0)
+    {
+        b->nodes[0].box = aabb_empty();
+        b->nodes[0].left_first = 0;
+        b->nodes[0].count = 0;
+    }
+    else
+    {
+#pragma omp parallel
+#pragma omp single
+        bvh_build_node(b, bounds, centroids, 0, 0, prim_num, 0);
+    }
+    free(centroids);
+
+    gettimeofday(&t2, NULL);
+
+    b->stats = (bvh_stats){0};
+    b->stats.build_sec = time_diff_sec(t1, t2);
+    b->stats.node_num = b->node_num;
+    if (prim_num > 0)
+        bvh_collect_stats(b, 0, 0, aabb_surface_area(b->nodes[0].box));
+}
+
+void bvh_report(const bvh *b)
+{
+    printf("bvh build %f sec, %zu primitives, %zu nodes, %zu leaves, depth %d, sah cost %f\n",
+           b->stats.build_sec, b->prim_num, b->stats.node_num, b->stats.leaf_num,
+           b->stats.depth, b->stats.sah_cost);
+}
+
+void bvh_free(bvh *b)
+{
+    free(b->nodes);
+    free(b->index);
+    b->nodes = NULL;
+    b->index = NULL;
+    b->node_num = 0;
+    b->prim_num = 0;
+}
+
+// ====== traversal ======
+
+// test every primitive of a leaf and update closest
+// return the primitive that replaced closest or BVH_NO_HIT
+typedef size_t (*bvh_hit_leaf_fn)(const void *ctx, const bvh_node *leaf, size_t node_index,
+                                  ray ry, hit_record_geometry *closest);
+
+// return the primitive of the closest hit or BVH_NO_HIT
+static inline size_t bvh_closest_hit(const bvh *b, ray ry, hit_record_geometry *closest,
+                                     bvh_hit_leaf_fn hit_leaf, const void *ctx)
+{
+    size_t hit_index = BVH_NO_HIT;
+    closest->t = -1.0;
+
+    vec3 inv_dir = vec3_make(REAL(1.0) / ry.direction.x, REAL(1.0) / ry.direction.y, REAL(1.0) / ry.direction.z);
+
+    uint32_t stack[BVH_STACK_SIZE];
+    int sp = 0;
+    real t_near;
+
+    if (b->prim_num == 0 || !hit_aabb(&b->nodes[0].box, ry, inv_dir, INFINITY, &t_near))
+        return hit_index;
+    stack[sp++] = 0;
+
+    while (sp > 0)
+    {
+        uint32_t node_index = stack[--sp];
+        const bvh_node *node = &b->nodes[node_index];
+        real t_max = closest->t < REAL(0.0) ? INFINITY : closest->t;
+
+        if (bvh_is_leaf(node))
+        {
+            size_t leaf_hit = hit_leaf(ctx, node, node_index, ry, closest);
+            if (leaf_hit != BVH_NO_HIT)
+                hit_index = leaf_hit;
+            continue;
+        }
+
+        real t_left, t_right;
+        bool hit_left = hit_aabb(&b->nodes[node->left_first].box, ry, inv_dir, t_max, &t_left);
+        bool hit_right = hit_aabb(&b->nodes[node->left_first + 1].box, ry, inv_dir, t_max, &t_right);
+
+        // push the far child first so that the near child is visited first
+        if (hit_left && hit_right)
+        {
+            if (t_left <= t_right)
+            {
+                stack[sp++] = node->left_first + 1;
+                stack[sp++] = node->left_first;
+            }
+            else
+            {
+                stack[sp++] = node->left_first;
+                stack[sp++] = node->left_first + 1;
+            }
+        }
+        else if (hit_left)
+        {
+            stack[sp++] = node->left_first;
+        }
+        else if (hit_right)
+        {
+            stack[sp++] = node->left_first + 1;
+        }
+    }
+
+    return hit_index;
+}
+
+// any-hit query: does some primitive hit the ray closer than t_max.
+// occluded_leaf tests the primitives of a leaf and the traversal stops at the first hit,
+// children are not ordered since any hit will do
+typedef bool (*bvh_occluded_leaf_fn)(const void *ctx, const bvh_node *leaf, size_t node_index,
+                                     ray r, real t_max);
+
+static inline bool bvh_any_hit(const bvh *b, ray ry, real t_max,
+                               bvh_occluded_leaf_fn occluded_leaf, const void *ctx)
+{
+    vec3 inv_dir = vec3_make(REAL(1.0) / ry.direction.x, REAL(1.0) / ry.direction.y, REAL(1.0) / ry.direction.z);
+
+    uint32_t stack[BVH_STACK_SIZE];
+    int sp = 0;
+    real t_near;
+
+    if (b->prim_num == 0 || !hit_aabb(&b->nodes[0].box, ry, inv_dir, t_max, &t_near))
+        return false;
+    stack[sp++] = 0;
+
+    while (sp > 0)
+    {
+        const bvh_node *node = &b->nodes[stack[--sp]];
+
+        if (bvh_is_leaf(node))
+        {
+            if (occluded_leaf(ctx, node, node - b->nodes, ry, t_max))
+                return true;
+            continue;
+        }
+
+        if (hit_aabb(&b->nodes[node->left_first + 1].box, ry, inv_dir, t_max, &t_near))
+            stack[sp++] = node->left_first + 1;
+        if (hit_aabb(&b->nodes[node->left_first].box, ry, inv_dir, t_max, &t_near))
+            stack[sp++] = node->left_first;
+    }
+
+    return false;
+}
+
+#endif
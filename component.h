@@ -6,20 +6,21 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include "vec3.h"
+#include "stats.h"
 
 // ====== hit record ======
 
 typedef struct
 {
     ray r;
-    double t;
+    real t;
     vec3 normal;
 } hit_record_geometry;
 
 // ray direction is from outside or not
 bool hit_from_outer(hit_record_geometry rec)
 {
-    return vec3_dot(rec.normal, rec.r.direction) < 0.0;
+    return vec3_dot(rec.normal, rec.r.direction) < REAL(0.0);
 }
 
 point point_of_hit(hit_record_geometry rec)
@@ -29,11 +30,11 @@ point point_of_hit(hit_record_geometry rec)
 
 bool hit_record_closer(hit_record_geometry *rec, hit_record_geometry new_rec)
 {
-    if (new_rec.t < 0.0)
+    if (new_rec.t < REAL(0.0))
     {
         return false;
     }
-    if (rec->t < 0.0 || new_rec.t < rec->t)
+    if (rec->t < REAL(0.0) || new_rec.t < rec->t)
     {
         *rec = new_rec;
         return true;
@@ -41,38 +42,119 @@ bool hit_record_closer(hit_record_geometry *rec, hit_record_geometry new_rec)
     return false;
 }
 
+// ====== bounding box ======
+
+typedef struct
+{
+    point min, max;
+} aabb;
+
+static inline aabb aabb_empty(void)
+{
+    aabb box;
+    box.min = vec3_make(INFINITY, INFINITY, INFINITY);
+    box.max = vec3_make(-INFINITY, -INFINITY, -INFINITY);
+    return box;
+}
+
+static inline aabb aabb_union(aabb a, aabb b)
+{
+    aabb box;
+    box.min = vec3_min(a.min, b.min);
+    box.max = vec3_max(a.max, b.max);
+    return box;
+}
+
+static inline aabb aabb_extend(aabb a, point p)
+{
+    aabb box;
+    box.min = vec3_min(a.min, p);
+    box.max = vec3_max(a.max, p);
+    return box;
+}
+
+static inline point aabb_centroid(aabb a)
+{
+    return vec3_scale(vec3_add(a.min, a.max), 0.5);
+}
+
+static inline real min_real(real a, real b)
+{
+    return a < b ? a : b;
+}
+
+static inline real max_real(real a, real b)
+{
+    return a > b ? a : b;
+}
+
+static inline real aabb_surface_area(aabb a)
+{
+    vec3 d = vec3_sub(a.max, a.min);
+    if (d.x < REAL(0.0) || d.y < REAL(0.0) || d.z < REAL(0.0))
+        return 0.0;
+    return REAL(2.0) * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+// slab test against [0, t_max]
+// inv_dir is 1 / ry.direction per component, t_near receives the entry distance
+static inline bool hit_aabb(const aabb *box, ray ry, vec3 inv_dir, real t_max, real *t_near)
+{
+    real tx1 = (box->min.x - ry.origin.x) * inv_dir.x;
+    real tx2 = (box->max.x - ry.origin.x) * inv_dir.x;
+    real tmin = min_real(tx1, tx2);
+    real tmax = max_real(tx1, tx2);
+
+    real ty1 = (box->min.y - ry.origin.y) * inv_dir.y;
+    real ty2 = (box->max.y - ry.origin.y) * inv_dir.y;
+    tmin = max_real(tmin, min_real(ty1, ty2));
+    tmax = min_real(tmax, max_real(ty1, ty2));
+
+    real tz1 = (box->min.z - ry.origin.z) * inv_dir.z;
+    real tz2 = (box->max.z - ry.origin.z) * inv_dir.z;
+    tmin = max_real(tmin, min_real(tz1, tz2));
+    tmax = min_real(tmax, max_real(tz1, tz2));
+
+    *t_near = tmin;
+    return tmax >= max_real(tmin, 0.0) && tmin <= t_max;
+}
+
 // ====== geometry ======
 
 typedef enum
 {
     SPHERE,
     TRIANGLE,
+    MESH,     // mesh.h
+    INSTANCE, // a placed copy of shared geometry, world_entity*.h
 } geometry_type;
+#define GEOMETRY_TYPE_NUM (INSTANCE + 1)
 
 // ------ sphere ------
 
 typedef struct
 {
     point center;
-    double radius;
+    real radius;
 } sphere;
 
 hit_record_geometry hit_sphere(sphere *sph, ray ry)
 {
+    STATS_INC(STAT_SPHERE_TESTS);
     hit_record_geometry rec;
     rec.t = -1.0;
 
     vec3 oc = vec3_sub(ry.origin, sph->center);
-    double a = vec3_dot(ry.direction, ry.direction);
-    double b = 2.0 * vec3_dot(oc, ry.direction);
-    double c = vec3_dot(oc, oc) - sph->radius * sph->radius;
-    double discriminant = b * b - 4 * a * c;
+    real a = vec3_dot(ry.direction, ry.direction);
+    real b = REAL(2.0) * vec3_dot(oc, ry.direction);
+    real c = vec3_dot(oc, oc) - sph->radius * sph->radius;
+    real discriminant = b * b - 4 * a * c;
 
     if (discriminant < 0)
         return rec; // No hit
 
-    double t = (-b - sqrt(discriminant)) / (2.0 * a);
-    if (t < 0.001)
+    real t = (-b - sqrt(discriminant)) / (REAL(2.0) * a);
+    if (t < HIT_EPSILON)
         return rec;
 
     rec.t = t;
@@ -83,52 +165,152 @@ hit_record_geometry hit_sphere(sphere *sph, ray ry)
     return rec;
 }
 
+// true when the ray hits the sphere at some t in [HIT_EPSILON, t_max], no record is built
+bool occluded_sphere(sphere *sph, ray ry, real t_max)
+{
+    STATS_INC(STAT_SPHERE_TESTS);
+    vec3 oc = vec3_sub(ry.origin, sph->center);
+    real a = vec3_dot(ry.direction, ry.direction);
+    real b = REAL(2.0) * vec3_dot(oc, ry.direction);
+    real c = vec3_dot(oc, oc) - sph->radius * sph->radius;
+    real discriminant = b * b - 4 * a * c;
+
+    if (discriminant < 0)
+        return false;
+
+    real t = (-b - sqrt(discriminant)) / (REAL(2.0) * a);
+    return t >= HIT_EPSILON && t <= t_max;
+}
+
+aabb bounds_sphere(sphere *sph)
+{
+    vec3 r = vec3_make(sph->radius, sph->radius, sph->radius);
+    aabb box;
+    box.min = vec3_sub(sph->center, r);
+    box.max = vec3_add(sph->center, r);
+    return box;
+}
+
+// uniform point on the surface, normal receives the outward normal there
+point sample_sphere(sphere *sph, unsigned int *state, vec3 *normal)
+{
+    *normal = random_unit_vector(state);
+    return vec3_add(sph->center, vec3_scale(*normal, sph->radius));
+}
+
+real area_sphere(sphere *sph)
+{
+    return REAL(4.0) * MY_PI * sph->radius * sph->radius;
+}
+
 // ------ triangle ------
+// det below this is a ray parallel to the triangle or a back face hit. it is not relative to a unit direction:
+// rays moved into a scaled instance are not normalized and det shrinks with the scale
+#define TRIANGLE_DET_EPSILON REAL(1e-12)
+
+// as read from the scene file, triangle_precompute turns it into triangle_pre
 typedef struct
 {
     point a, b, c;
 } triangle;
 
-hit_record_geometry hit_triangle(triangle *tri, ray ry)
+// the form the renderers keep: the edges and the unit normal are computed once in
+// setup_scene instead of on every ray test.
+typedef struct
 {
-    hit_record_geometry rec;
-    rec.t = -1.0;
+    point a;
+    vec3 ab, ac;
+    vec3 normal; // unit, on the side hit_triangle_pre sees
+} triangle_pre;
 
-    vec3 ab = vec3_sub(tri->b, tri->a);
-    vec3 ac = vec3_sub(tri->c, tri->a);
-    vec3 pvec = vec3_cross(ry.direction, ac);
-    double det = vec3_dot(ab, pvec);
+triangle_pre triangle_precompute(triangle tri)
+{
+    triangle_pre pre;
+    pre.a = tri.a;
+    pre.ab = vec3_sub(tri.b, tri.a);
+    pre.ac = vec3_sub(tri.c, tri.a);
+    pre.normal = vec3_unit(vec3_cross(pre.ab, pre.ac));
+    return pre;
+}
 
-    if (det < 0.001)
-        return rec;
+// Möller–Trumbore, return t of a front face hit or -1, the caller checks t against its range
+static inline real intersect_triangle_pre(const triangle_pre *tri, ray ry)
+{
+    STATS_INC(STAT_TRIANGLE_TESTS);
+    vec3 pvec = vec3_cross(ry.direction, tri->ac);
+    real det = vec3_dot(tri->ab, pvec);
+
+    if (det < TRIANGLE_DET_EPSILON)
+        return -1.0;
 
-    double inv_det = 1.0 / det;
+    real inv_det = REAL(1.0) / det;
 
     vec3 tvec = vec3_sub(ry.origin, tri->a);
-    double u = inv_det * vec3_dot(tvec, pvec);
+    real u = inv_det * vec3_dot(tvec, pvec);
 
-    if (u < 0.0 || u > 1.0)
-        return rec;
+    if (u < REAL(0.0) || u > REAL(1.0))
+        return -1.0;
 
-    vec3 qvec = vec3_cross(tvec, ab);
-    double v = inv_det * vec3_dot(ry.direction, qvec);
+    vec3 qvec = vec3_cross(tvec, tri->ab);
+    real v = inv_det * vec3_dot(ry.direction, qvec);
 
-    if (v < 0.0 || u + v > 1.0)
-        return rec;
+    if (v < REAL(0.0) || u + v > REAL(1.0))
+        return -1.0;
+
+    return inv_det * vec3_dot(tri->ac, qvec);
+}
 
-    double t = inv_det * vec3_dot(ac, qvec);
+hit_record_geometry hit_triangle_pre(triangle_pre *tri, ray ry)
+{
+    hit_record_geometry rec;
+    rec.t = -1.0;
 
-    if (t < 0.001)
+    real t = intersect_triangle_pre(tri, ry);
+    if (t < HIT_EPSILON)
         return rec;
 
     rec.t = t;
     rec.r = ry;
-    vec3 outward_normal = vec3_unit(vec3_cross(ab, ac));
-    rec.normal = outward_normal;
+    rec.normal = tri->normal;
 
     return rec;
 }
 
+// true when the ray hits the triangle at some t in [HIT_EPSILON, t_max], no record is built
+bool occluded_triangle_pre(triangle_pre *tri, ray ry, real t_max)
+{
+    real t = intersect_triangle_pre(tri, ry);
+    return t >= HIT_EPSILON && t <= t_max;
+}
+
+aabb bounds_triangle_pre(triangle_pre *tri)
+{
+    aabb box = aabb_empty();
+    box = aabb_extend(box, tri->a);
+    box = aabb_extend(box, vec3_add(tri->a, tri->ab));
+    box = aabb_extend(box, vec3_add(tri->a, tri->ac));
+    return box;
+}
+
+// uniform point on the triangle, normal receives the front face normal
+point sample_triangle_pre(triangle_pre *tri, unsigned int *state, vec3 *normal)
+{
+    real u = rand_unit(state);
+    real v = rand_unit(state);
+    if (u + v > REAL(1.0))
+    {
+        u = REAL(1.0) - u;
+        v = REAL(1.0) - v;
+    }
+    *normal = tri->normal;
+    return vec3_add(tri->a, vec3_add(vec3_scale(tri->ab, u), vec3_scale(tri->ac, v)));
+}
+
+real area_triangle_pre(triangle_pre *tri)
+{
+    return REAL(0.5) * vec3_length(vec3_cross(tri->ab, tri->ac));
+}
+
 // ====== materials ======
 
 typedef enum
@@ -136,14 +318,16 @@ typedef enum
     METAL,
     LAMBERTIAN,
     DIELECTRIC,
+    EMISSIVE,
 } material_type;
+#define MATERIAL_TYPE_NUM (EMISSIVE + 1)
 
 // ------ metal ------
 
 typedef struct
 {
     color col;
-    double fuzz;
+    real fuzz;
 } metal;
 
 ray scatter_metal(metal *m, hit_record_geometry rec, unsigned int *state)
@@ -170,10 +354,12 @@ typedef struct
 
 ray scatter_lambertian(lambertian *l, hit_record_geometry rec, unsigned int *state)
 {
-    vec3 target = vec3_add(rec.normal, random_unit_vector(state));
-    if (vec3_length(target) < 0.001)
+    // mesh triangles are two-sided, bounce on the side the ray came from (as direct_light does)
+    vec3 normal = hit_from_outer(rec) ? rec.normal : vec3_inv(rec.normal);
+    vec3 target = vec3_add(normal, random_unit_vector(state));
+    if (vec3_length(target) < REAL(0.001))
     {
-        target = rec.normal;
+        target = normal;
     }
     ray r = ray_make(point_of_hit(rec), target);
     return r;
@@ -189,7 +375,7 @@ color color_transform_lambertian(lambertian *l, color col, unsigned int *state)
 typedef struct
 {
     color albedo;
-    double ref_idx;
+    real ref_idx;
 } dielectric;
 
 ray scatter_dielectric(dielectric *d, hit_record_geometry rec, unsigned int *state)
@@ -198,21 +384,21 @@ ray scatter_dielectric(dielectric *d, hit_record_geometry rec, unsigned int *sta
     bool is_front = hit_from_outer(rec);
     outward_normal = is_front ? rec.normal : vec3_inv(rec.normal);
 
-    double etai_over_etat = is_front ? (1.0 / d->ref_idx): d->ref_idx;
+    real etai_over_etat = is_front ? (REAL(1.0) / d->ref_idx): d->ref_idx;
 
     vec3 unit_direction = vec3_unit(rec.r.direction);
 
-    double cos_theta = fmin(vec3_dot(vec3_inv(unit_direction), outward_normal), 1.0);
-    double sin_theta = sqrt(1.0 - cos_theta * cos_theta);
+    real cos_theta = fmin(vec3_dot(vec3_inv(unit_direction), outward_normal), REAL(1.0));
+    real sin_theta = sqrt(REAL(1.0) - cos_theta * cos_theta);
 
-    if (etai_over_etat * sin_theta > 1.0)
+    if (etai_over_etat * sin_theta > REAL(1.0))
     {
         // total internal reflection
         vec3 reflected = vec3_reflect(unit_direction, outward_normal);
         return ray_make(point_of_hit(rec), reflected);
     }
 
-    double reflect_prob = schlick(cos_theta, etai_over_etat);
+    real reflect_prob = schlick(cos_theta, etai_over_etat);
 
     if (rand_unit(state) < reflect_prob)
     {
@@ -229,4 +415,16 @@ color color_transform_dielectric(dielectric *d, color col, unsigned int *state)
     return color_attenuation(col, albedo);
 }
 
+// ------ emissive ------
+// a light source, paths end when they hit it
+typedef struct
+{
+    color emit; // radiance, may be above 1
+} emissive;
+
+color emitted_emissive(emissive *e)
+{
+    return e->emit;
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,251 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+// 実行時に変えられる設定。settings.h の値が既定値で、
+// コマンドライン (--width 1920 など) か設定ファイル (1 行に "width 1920") で上書きする。
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <limits.h>
+#include "settings.h"
+#include "image.h"
+
+#define CONFIG_PATH_LEN 256
+
+typedef enum
+{
+    INTEGRATOR_BACKWARD, // keep the hit materials and apply them from the last one, fixed depth
+    INTEGRATOR_FORWARD,  // carry the throughput along the path with Russian roulette
+} integrator_type;
+
+typedef struct
+{
+    int width, height;
+    int samples;
+    int max_depth;
+    unsigned int frame;
+    char scene[CONFIG_PATH_LEN];
+    char output[CONFIG_PATH_LEN];
+    bool ascii;  // P3 instead of binary P6
+    bool gamma;  // gamma 2 when converting to 8 bit
+    bool stream; // write rows or tiles to the output as they finish
+    int pass;    // samples per pixel in one progressive pass, 0 for a single pass
+    char checkpoint[CONFIG_PATH_LEN]; // saved after every pass when set
+    bool resume; // continue from the checkpoint if it exists
+    double noise;    // adaptive sampling stops a pixel at this relative error, 0 to disable
+    int min_samples; // samples per pixel before adaptive sampling may stop it
+    integrator_type integrator;
+    int rr_depth; // bounces before Russian roulette may end a forward path
+    bool nee;     // forward paths sample lights directly at diffuse hits
+    bool quiet;   // no log line per scene object, mesh and render thread
+    int tile;     // side of the square tiles handed to render threads (ray_tracing_comb_omp)
+    char scene_cache[CONFIG_PATH_LEN]; // binary copy of the built scene, see scene_cache.h
+} render_config;
+
+static render_config CONFIG;
+
+static bool config_int(const char *value, long min, long max, long *out)
+{
+    char *end;
+    long v = strtol(value, &end, 0);
+    if (end == value || *end != '\0' || v < min || v > max)
+        return false;
+    *out = v;
+    return true;
+}
+
+static bool config_path(const char *value, char *out)
+{
+    if (strlen(value) >= CONFIG_PATH_LEN)
+        return false;
+    strcpy(out, value);
+    return true;
+}
+
+static bool config_real(const char *value, double min, double max, double *out)
+{
+    char *end;
+    double v = strtod(value, &end);
+    if (end == value || *end != '\0' || !(v >= min && v <= max))
+        return false;
+    *out = v;
+    return true;
+}
+
+// set one key, return false for an unknown key or a bad value
+static bool config_set(render_config *cfg, const char *key, const char *value)
+{
+    long v;
+    double d;
+    if (strcmp(key, "width") == 0 && config_int(value, 2, 65535, &v))
+        cfg->width = v;
+    else if (strcmp(key, "height") == 0 && config_int(value, 2, 65535, &v))
+        cfg->height = v;
+    else if (strcmp(key, "samples") == 0 && config_int(value, 1, INT_MAX, &v))
+        cfg->samples = v;
+    else if (strcmp(key, "depth") == 0 && config_int(value, 1, CONFIG_MAX_DEPTH, &v))
+        cfg->max_depth = v;
+    else if (strcmp(key, "frame") == 0 && config_int(value, 0, UINT_MAX, &v))
+        cfg->frame = v;
+    else if (strcmp(key, "ascii") == 0 && config_int(value, 0, 1, &v))
+        cfg->ascii = v;
+    else if (strcmp(key, "gamma") == 0 && config_int(value, 0, 1, &v))
+        cfg->gamma = v;
+    else if (strcmp(key, "stream") == 0 && config_int(value, 0, 1, &v))
+        cfg->stream = v;
+    else if (strcmp(key, "pass") == 0 && config_int(value, 0, INT_MAX, &v))
+        cfg->pass = v;
+    else if (strcmp(key, "resume") == 0 && config_int(value, 0, 1, &v))
+        cfg->resume = v;
+    else if (strcmp(key, "noise") == 0 && config_real(value, 0.0, 1e9, &d))
+        cfg->noise = d;
+    else if (strcmp(key, "min_samples") == 0 && config_int(value, 2, INT_MAX, &v))
+        cfg->min_samples = v;
+    else if (strcmp(key, "quiet") == 0 && config_int(value, 0, 1, &v))
+        cfg->quiet = v;
+    else if (strcmp(key, "scene_cache") == 0)
+        return config_path(value, cfg->scene_cache);
+    else if (strcmp(key, "checkpoint") == 0)
+        return config_path(value, cfg->checkpoint);
+    else if (strcmp(key, "scene") == 0)
+        return config_path(value, cfg->scene);
+    else if (strcmp(key, "output") == 0)
+        return config_path(value, cfg->output);
+    else if (strcmp(key, "integrator") == 0 && strcmp(value, "backward") == 0)
+        cfg->integrator = INTEGRATOR_BACKWARD;
+    else if (strcmp(key, "integrator") == 0 && strcmp(value, "forward") == 0)
+        cfg->integrator = INTEGRATOR_FORWARD;
+    else if (strcmp(key, "nee") == 0 && config_int(value, 0, 1, &v))
+        cfg->nee = v;
+    else if (strcmp(key, "rr_depth") == 0 && config_int(value, 1, CONFIG_MAX_DEPTH, &v))
+        cfg->rr_depth = v;
+    else if (strcmp(key, "tile") == 0 && config_int(value, 1, 65535, &v))
+        cfg->tile = v;
+    else
+        return false;
+    return true;
+}
+
+// "key value" per line, '#' starts a comment line
+static void config_load_file(render_config *cfg, const char *filename)
+{
+    FILE *fp = fopen(filename, "r");
+    if (!fp)
+    {
+        perror(filename);
+        exit(1);
+    }
+
+    char line[512];
+    while (fgets(line, sizeof(line), fp))
+    {
+        char key[64], value[CONFIG_PATH_LEN];
+        int matched = sscanf(line, "%63s %255s", key, value);
+        if (matched <= 0 || key[0] == '#')
+            continue;
+        if (matched != 2 || !config_set(cfg, key, value))
+        {
+            fprintf(stderr, "%s: bad setting: %s", filename, line);
+            exit(1);
+        }
+    }
+    fclose(fp);
+}
+
+static void config_usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [--width N] [--height N] [--samples N] [--depth N] [--frame N]\n"
+            "          [--scene FILE] [--output FILE] [--config FILE]\n"
+            "          [--ascii 0|1] [--gamma 0|1] [--stream 0|1]\n"
+            "          [--pass N] [--checkpoint FILE] [--resume 0|1]\n"
+            "          [--noise T] [--min_samples N]\n"
+            "          [--integrator backward|forward] [--rr_depth N] [--nee 0|1]\n"
+            "          [--quiet 0|1] [--scene_cache FILE] [--tile N]\n",
+            prog);
+}
+
+// fill CONFIG from settings.h and the command line, exit on a bad option
+void parse_args(int argc, char *argv[], const char *default_output)
+{
+    CONFIG.width = WIDTH;
+    CONFIG.height = HEIGHT;
+    CONFIG.samples = SAMPLING;
+    CONFIG.max_depth = 0; // depends on the integrator, set after the options
+    CONFIG.frame = FRAME;
+    config_path(SCENE_FILENAME, CONFIG.scene);
+    config_path(default_output, CONFIG.output);
+    CONFIG.ascii = false;
+    CONFIG.gamma = false;
+    CONFIG.stream = false;
+    CONFIG.pass = 0;
+    CONFIG.checkpoint[0] = '\0';
+    CONFIG.resume = false;
+    CONFIG.noise = 0.0;
+    CONFIG.min_samples = ADAPTIVE_MIN_SAMPLES;
+    CONFIG.integrator = INTEGRATOR_BACKWARD;
+    CONFIG.rr_depth = RR_MIN_DEPTH;
+    CONFIG.nee = true;
+    CONFIG.quiet = false;
+    CONFIG.scene_cache[0] = '\0';
+    CONFIG.tile = TILE_SIZE;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--help") == 0)
+        {
+            config_usage(argv[0]);
+            exit(0);
+        }
+        if (strncmp(argv[i], "--", 2) != 0 || i + 1 >= argc)
+        {
+            config_usage(argv[0]);
+            exit(1);
+        }
+
+        const char *key = argv[i] + 2;
+        const char *value = argv[++i];
+        if (strcmp(key, "config") == 0)
+        {
+            config_load_file(&CONFIG, value);
+        }
+        else if (!config_set(&CONFIG, key, value))
+        {
+            fprintf(stderr, "bad option: --%s %s\n", key, value);
+            config_usage(argv[0]);
+            exit(1);
+        }
+    }
+
+    // roulette ends forward paths, the depth only stops the rare endless one (light trapped in glass)
+    if (CONFIG.max_depth == 0)
+        CONFIG.max_depth = CONFIG.integrator == INTEGRATOR_FORWARD ? CONFIG_MAX_DEPTH : MAX_REFLECTION_DEPTH;
+
+    if (CONFIG.stream && (CONFIG.ascii || is_pfm_filename(CONFIG.output)))
+    {
+        fprintf(stderr, "--stream writes binary ppm only\n");
+        exit(1);
+    }
+    if (CONFIG.stream && CONFIG.noise > 0.0)
+    {
+        fprintf(stderr, "--stream does not work with adaptive sampling\n");
+        exit(1);
+    }
+    if (CONFIG.resume && CONFIG.checkpoint[0] == '\0')
+    {
+        fprintf(stderr, "--resume needs --checkpoint FILE\n");
+        exit(1);
+    }
+#if PACKET_TILE > 0
+    // a packet never straddles two tiles
+    if (CONFIG.tile % PACKET_TILE != 0)
+    {
+        fprintf(stderr, "--tile must be a multiple of %d in a packet build\n", PACKET_TILE);
+        exit(1);
+    }
+#endif
+}
+
+#endif
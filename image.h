@@ -0,0 +1,255 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+// 描画先の画像 (framebuffer) とファイルへの書き出し。
+// 既定はバイナリの ppm (P6) で、1 回の fwrite でまとめて書く。
+// ppm_stream を使うと、描き終わった行やタイルをその場でファイルに書き込める。
+// 出力ファイル名が .pfm なら 8 bit に丸めず float のまま (PFM) で書く。
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include "vec3.h"
+
+typedef struct
+{
+    int width, height;
+    color *pixels; // row 0 is the top of the image
+} framebuffer;
+
+framebuffer framebuffer_make(int width, int height)
+{
+    framebuffer fb;
+    fb.width = width;
+    fb.height = height;
+    fb.pixels = calloc((size_t)width * height, sizeof(color));
+    if (!fb.pixels)
+    {
+        perror("framebuffer");
+        exit(EXIT_FAILURE);
+    }
+    return fb;
+}
+
+void framebuffer_free(framebuffer *fb)
+{
+    free(fb->pixels);
+    fb->pixels = NULL;
+}
+
+static inline color *framebuffer_at(framebuffer *fb, int x, int row)
+{
+    return &fb->pixels[(size_t)row * fb->width + x];
+}
+
+void framebuffer_scale(framebuffer *fb, real s)
+{
+    for (size_t i = 0; i < (size_t)fb->width * fb->height; ++i)
+    {
+        fb->pixels[i] = vec3_scale(fb->pixels[i], s);
+    }
+}
+
+// convert pixels [x0, x1) of a row, multiplied by scale, to rgb bytes
+static void framebuffer_row_rgb8(framebuffer *fb, int row, int x0, int x1, real scale, bool gamma, unsigned char *out)
+{
+    for (int x = x0; x < x1; ++x)
+    {
+        color c = vec3_scale(*framebuffer_at(fb, x, row), scale);
+        *out++ = color_byte(c.x, gamma);
+        *out++ = color_byte(c.y, gamma);
+        *out++ = color_byte(c.z, gamma);
+    }
+}
+
+static int ppm_header(char *buf, size_t size, int width, int height)
+{
+    return snprintf(buf, size, "P6\n%d %d\n255\n", width, height);
+}
+
+// binary ppm (P6), converted into one buffer and written at once
+void save_ppm(const char *filename, framebuffer *fb, bool gamma)
+{
+    char header[64];
+    int header_len = ppm_header(header, sizeof(header), fb->width, fb->height);
+    size_t row_bytes = (size_t)fb->width * 3;
+    unsigned char *data = malloc(row_bytes * fb->height);
+    if (!data)
+    {
+        perror("save_ppm");
+        exit(EXIT_FAILURE);
+    }
+    for (int y = 0; y < fb->height; ++y)
+    {
+        framebuffer_row_rgb8(fb, y, 0, fb->width, 1.0, gamma, data + row_bytes * y);
+    }
+
+    FILE *f = fopen(filename, "wb");
+    if (!f)
+    {
+        perror("fopen");
+        exit(EXIT_FAILURE);
+    }
+    if (fwrite(header, 1, header_len, f) != (size_t)header_len ||
+        fwrite(data, 1, row_bytes * fb->height, f) != row_bytes * fb->height)
+    {
+        perror(filename);
+        exit(EXIT_FAILURE);
+    }
+    fclose(f);
+    free(data);
+}
+
+// ascii ppm (P3), one line per pixel
+void save_ppm_ascii(const char *filename, framebuffer *fb, bool gamma)
+{
+    FILE *f = fopen(filename, "w");
+    if (!f)
+    {
+        perror("fopen");
+        exit(EXIT_FAILURE);
+    }
+
+    fprintf(f, "P3\n%d %d\n255\n", fb->width, fb->height);
+    for (int y = 0; y < fb->height; ++y)
+        for (int x = 0; x < fb->width; ++x)
+        {
+            if (gamma)
+                write_color_gamma(f, *framebuffer_at(fb, x, y));
+            else
+                write_color(f, *framebuffer_at(fb, x, y));
+        }
+    fclose(f);
+}
+
+// binary ppm whose pixels are written as soon as they are rendered.
+// the file is sized up front, so finished rectangles can be written in any order
+// and pixels that are not rendered yet read as black.
+typedef struct
+{
+    int fd;
+    int width, height;
+    off_t data_offset;
+    real scale; // the framebuffer may hold sums of samples, see progressive.h
+    bool gamma;
+} ppm_stream;
+
+void ppm_stream_open(ppm_stream *s, const char *filename, int width, int height, bool gamma)
+{
+    char header[64];
+    int header_len = ppm_header(header, sizeof(header), width, height);
+
+    s->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (s->fd < 0)
+    {
+        perror(filename);
+        exit(EXIT_FAILURE);
+    }
+    s->width = width;
+    s->height = height;
+    s->data_offset = header_len;
+    s->scale = 1.0;
+    s->gamma = gamma;
+
+    // writing the last byte sizes the file, the rest reads as zero
+    off_t last = s->data_offset + (off_t)width * height * 3 - 1;
+    if (write(s->fd, header, header_len) != header_len ||
+        lseek(s->fd, last, SEEK_SET) != last || write(s->fd, "", 1) != 1)
+    {
+        perror(filename);
+        exit(EXIT_FAILURE);
+    }
+}
+
+// write the finished rectangle [x0, x1) x [row0, row1) of fb, safe to call from any thread
+void ppm_stream_write(ppm_stream *s, framebuffer *fb, int x0, int row0, int x1, int row1)
+{
+    size_t bytes = (size_t)(x1 - x0) * 3;
+    unsigned char *buf = malloc(bytes);
+    for (int row = row0; row < row1; ++row)
+    {
+        framebuffer_row_rgb8(fb, row, x0, x1, s->scale, s->gamma, buf);
+        off_t offset = s->data_offset + ((off_t)row * s->width + x0) * 3;
+        bool ok;
+#pragma omp critical(ppm_stream)
+        ok = lseek(s->fd, offset, SEEK_SET) == offset && write(s->fd, buf, bytes) == (ssize_t)bytes;
+        if (!ok)
+        {
+            perror("ppm_stream_write");
+            exit(EXIT_FAILURE);
+        }
+    }
+    free(buf);
+}
+
+void ppm_stream_close(ppm_stream *s)
+{
+    close(s->fd);
+    s->fd = -1;
+}
+
+// float32 rgb (PFM), linear and unclamped, written at once.
+// PFM stores the bottom row first, a negative scale means little endian.
+void save_pfm(const char *filename, framebuffer *fb)
+{
+    const uint16_t probe = 1;
+    bool little_endian = *(const unsigned char *)&probe == 1;
+
+    char header[64];
+    int header_len = snprintf(header, sizeof(header), "PF\n%d %d\n%s\n",
+                              fb->width, fb->height, little_endian ? "-1.0" : "1.0");
+    size_t n = (size_t)fb->width * fb->height * 3;
+    float *data = malloc(sizeof(float) * n);
+    if (!data)
+    {
+        perror("save_pfm");
+        exit(EXIT_FAILURE);
+    }
+    float *out = data;
+    for (int y = fb->height - 1; y >= 0; --y)
+        for (int x = 0; x < fb->width; ++x)
+        {
+            color c = *framebuffer_at(fb, x, y);
+            *out++ = (float)c.x;
+            *out++ = (float)c.y;
+            *out++ = (float)c.z;
+        }
+
+    FILE *f = fopen(filename, "wb");
+    if (!f)
+    {
+        perror("fopen");
+        exit(EXIT_FAILURE);
+    }
+    if (fwrite(header, 1, header_len, f) != (size_t)header_len ||
+        fwrite(data, sizeof(float), n, f) != n)
+    {
+        perror(filename);
+        exit(EXIT_FAILURE);
+    }
+    fclose(f);
+    free(data);
+}
+
+static bool is_pfm_filename(const char *filename)
+{
+    size_t len = strlen(filename);
+    return len >= 4 && strcmp(filename + len - 4, ".pfm") == 0;
+}
+
+// write the finished image in the format chosen by the settings
+void save_image(const char *filename, framebuffer *fb, bool ascii, bool gamma)
+{
+    if (is_pfm_filename(filename))
+        save_pfm(filename, fb);
+    else if (ascii)
+        save_ppm_ascii(filename, fb, gamma);
+    else
+        save_ppm(filename, fb, gamma);
+}
+
+#endif
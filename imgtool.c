@@ -0,0 +1,286 @@
+// レンダリング結果の画像を比べるための小さな道具。
+//   imgtool rmse a.ppm b.ppm                 : 2 枚の画像の差 (RMSE と PSNR) を表示する
+//   imgtool average out.pfm in1.pfm in2.pfm ... : 同じサンプル数で描いた PFM を平均する
+//     同じ設定の描画は同じ画像になるので、入力はそれぞれ別の --frame で描くこと (乱数列が frame で変わる)
+// rmse は ppm (P3/P6) と PFM のどちらも読める。
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <math.h>
+
+#define IMGTOOL_MAX_SIDE 65535 // the renderers take --width and --height up to this
+
+typedef struct
+{
+    int width, height;
+    double *data; // width * height * 3 values, top row first; [0, 1] for ppm
+} image_buf;
+
+// checks the size read from a header and allocates the raster
+static int image_alloc(const char *filename, image_buf *img)
+{
+    if (img->width <= 0 || img->height <= 0 || img->width > IMGTOOL_MAX_SIDE || img->height > IMGTOOL_MAX_SIDE)
+    {
+        fprintf(stderr, "%s: bad size %dx%d\n", filename, img->width, img->height);
+        return 0;
+    }
+    img->data = malloc(sizeof(double) * img->width * img->height * 3);
+    if (!img->data)
+    {
+        perror(filename);
+        return 0;
+    }
+    return 1;
+}
+
+// ppm, ascii (P3) or binary (P6) with 8 bit samples
+static int load_ppm(const char *filename, image_buf *img)
+{
+    FILE *f = fopen(filename, "rb");
+    if (!f)
+    {
+        perror(filename);
+        return 0;
+    }
+
+    char magic[3] = {0};
+    int maxval;
+    if (fscanf(f, "%2s %d %d %d", magic, &img->width, &img->height, &maxval) != 4 ||
+        (strcmp(magic, "P3") != 0 && strcmp(magic, "P6") != 0) || maxval <= 0 ||
+        (magic[1] == '6' && maxval > 255))
+    {
+        fprintf(stderr, "%s: not a ppm\n", filename);
+        fclose(f);
+        return 0;
+    }
+    bool binary = magic[1] == '6';
+    if (binary)
+        fgetc(f); // single whitespace before the raster
+
+    if (!image_alloc(filename, img))
+    {
+        fclose(f);
+        return 0;
+    }
+    size_t n = (size_t)img->width * img->height * 3;
+    for (size_t i = 0; i < n; ++i)
+    {
+        int v;
+        if (binary ? (v = fgetc(f)) == EOF : fscanf(f, "%d", &v) != 1)
+        {
+            fprintf(stderr, "%s: truncated\n", filename);
+            free(img->data);
+            fclose(f);
+            return 0;
+        }
+        img->data[i] = (double)v / maxval;
+    }
+    fclose(f);
+    return 1;
+}
+
+static bool host_little_endian(void)
+{
+    const uint16_t probe = 1;
+    return *(const unsigned char *)&probe == 1;
+}
+
+// float rgb (PF), rows stored bottom first
+static int load_pfm(const char *filename, image_buf *img)
+{
+    FILE *f = fopen(filename, "rb");
+    if (!f)
+    {
+        perror(filename);
+        return 0;
+    }
+
+    char magic[3] = {0};
+    double scale;
+    if (fscanf(f, "%2s %d %d %lf", magic, &img->width, &img->height, &scale) != 4 ||
+        strcmp(magic, "PF") != 0 || scale == 0.0)
+    {
+        fprintf(stderr, "%s: not a color pfm\n", filename);
+        fclose(f);
+        return 0;
+    }
+    fgetc(f); // single whitespace before the raster
+    bool swap = (scale < 0.0) != host_little_endian();
+
+    if (!image_alloc(filename, img))
+    {
+        fclose(f);
+        return 0;
+    }
+    size_t row_len = (size_t)img->width * 3;
+    float *row = malloc(sizeof(float) * row_len);
+    if (!row)
+    {
+        perror(filename);
+        free(img->data);
+        fclose(f);
+        return 0;
+    }
+    for (int y = img->height - 1; y >= 0; --y)
+    {
+        if (fread(row, sizeof(float), row_len, f) != row_len)
+        {
+            fprintf(stderr, "%s: truncated\n", filename);
+            free(row);
+            free(img->data);
+            fclose(f);
+            return 0;
+        }
+        for (size_t i = 0; i < row_len; ++i)
+        {
+            if (swap)
+            {
+                uint32_t u;
+                memcpy(&u, &row[i], sizeof(u));
+                u = (u >> 24) | ((u >> 8) & 0xff00u) | ((u << 8) & 0xff0000u) | (u << 24);
+                memcpy(&row[i], &u, sizeof(u));
+            }
+            img->data[(size_t)y * row_len + i] = row[i];
+        }
+    }
+    free(row);
+    fclose(f);
+    return 1;
+}
+
+static int load_image(const char *filename, image_buf *img)
+{
+    FILE *f = fopen(filename, "rb");
+    if (!f)
+    {
+        perror(filename);
+        return 0;
+    }
+    char magic[2] = {0};
+    size_t got = fread(magic, 1, 2, f);
+    fclose(f);
+    if (got == 2 && magic[0] == 'P' && magic[1] == 'F')
+        return load_pfm(filename, img);
+    return load_ppm(filename, img);
+}
+
+static int save_pfm(const char *filename, const image_buf *img)
+{
+    FILE *f = fopen(filename, "wb");
+    if (!f)
+    {
+        perror(filename);
+        return 0;
+    }
+    fprintf(f, "PF\n%d %d\n%s\n", img->width, img->height, host_little_endian() ? "-1.0" : "1.0");
+
+    size_t row_len = (size_t)img->width * 3;
+    float *data = malloc(sizeof(float) * row_len * img->height);
+    float *out = data;
+    for (int y = img->height - 1; y >= 0; --y)
+        for (size_t i = 0; i < row_len; ++i)
+        {
+            *out++ = (float)img->data[(size_t)y * row_len + i];
+        }
+    size_t n = row_len * img->height;
+    int ok = fwrite(data, sizeof(float), n, f) == n;
+    free(data);
+    fclose(f);
+    if (!ok)
+        perror(filename);
+    return ok;
+}
+
+static int rmse(const char *a_name, const char *b_name)
+{
+    image_buf a, b;
+    if (!load_image(a_name, &a))
+        return 1;
+    if (!load_image(b_name, &b))
+    {
+        free(a.data);
+        return 1;
+    }
+    if (a.width != b.width || a.height != b.height)
+    {
+        fprintf(stderr, "size mismatch: %dx%d and %dx%d\n", a.width, a.height, b.width, b.height);
+        free(a.data);
+        free(b.data);
+        return 1;
+    }
+
+    size_t n = (size_t)a.width * a.height * 3;
+    double sum[3] = {0.0, 0.0, 0.0};
+    for (size_t i = 0; i < n; ++i)
+    {
+        double d = a.data[i] - b.data[i];
+        sum[i % 3] += d * d;
+    }
+
+    double pixels = (double)a.width * a.height;
+    double total = sqrt((sum[0] + sum[1] + sum[2]) / n);
+    printf("rmse %f (r %f, g %f, b %f), psnr %f dB\n",
+           total, sqrt(sum[0] / pixels), sqrt(sum[1] / pixels), sqrt(sum[2] / pixels),
+           total > 0.0 ? -20.0 * log10(total) : INFINITY);
+
+    free(a.data);
+    free(b.data);
+    return 0;
+}
+
+// mean of the images, in double so the float inputs are summed without loss;
+// renders with the same settings are identical, so each input needs its own --frame
+static int average(const char *out_name, char *in_names[], int in_num)
+{
+    image_buf sum, img;
+    if (!load_image(in_names[0], &sum))
+        return 1;
+
+    size_t n = (size_t)sum.width * sum.height * 3;
+    for (int k = 1; k < in_num; ++k)
+    {
+        if (!load_image(in_names[k], &img))
+        {
+            free(sum.data);
+            return 1;
+        }
+        if (img.width != sum.width || img.height != sum.height)
+        {
+            fprintf(stderr, "size mismatch: %s is %dx%d, expected %dx%d\n",
+                    in_names[k], img.width, img.height, sum.width, sum.height);
+            free(img.data);
+            free(sum.data);
+            return 1;
+        }
+        for (size_t i = 0; i < n; ++i)
+        {
+            sum.data[i] += img.data[i];
+        }
+        free(img.data);
+    }
+
+    for (size_t i = 0; i < n; ++i)
+    {
+        sum.data[i] /= in_num;
+    }
+    int ok = save_pfm(out_name, &sum);
+    free(sum.data);
+    return ok ? 0 : 1;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc == 4 && strcmp(argv[1], "rmse") == 0)
+        return rmse(argv[2], argv[3]);
+    if (argc >= 4 && strcmp(argv[1], "average") == 0)
+        return average(argv[2], argv + 3, argc - 3);
+
+    fprintf(stderr, "usage: %s rmse a.ppm b.ppm\n"
+                    "       %s average out.pfm in1.pfm in2.pfm ...\n"
+                    "         (inputs rendered with the same sample count, each with its own --frame)\n",
+            argv[0], argv[0]);
+    return 1;
+}
@@ -0,0 +1,468 @@
+#ifndef MESH_H
+#define MESH_H
+
+// 頂点とインデックスを共有する三角形メッシュと、Wavefront OBJ の読み込み。
+// 三角形は頂点番号 3 つだけを持ち、頂点座標は隣り合う三角形で共有する。
+// メッシュは自分の BVH を持ち、シーンの BVH からは 1 つの entity に見える。
+// 同じファイルは一度だけ読み込み、それを参照するすべての entity で共有する。
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/time.h> // for time
+#include "vec3.h"
+#include "component.h"
+#include "bvh.h"
+#include "utils.h"
+
+#define MESH_NAME_LEN 256
+#define MESH_NO_NORMAL UINT32_MAX
+// |det| below this means the ray is parallel to the triangle
+#define MESH_DET_EPSILON REAL(1e-12)
+
+typedef struct
+{
+    char name[MESH_NAME_LEN]; // the file it was loaded from
+    size_t vertex_num, normal_num, triangle_num;
+    point *vertices;
+    vec3 *normals;            // vn of the file, NULL when it has none
+    uint32_t *indices;        // 3 vertices per triangle, counter-clockwise seen from the front
+    uint32_t *normal_indices; // 3 normals per triangle or MESH_NO_NORMAL, NULL without normals
+    bvh tree;                 // over the triangles, which are stored in leaf order
+    real *area_cdf;           // running sum of the triangle areas, built by area_mesh
+} mesh;
+
+// a mesh placed in the scene
+typedef struct
+{
+    mesh *m;
+} mesh_ref;
+
+// ====== intersection ======
+// triangles of a mesh are two-sided so that rays can leave a closed dielectric mesh,
+// an emissive mesh still lights its front side only (emitted_hit).
+// the normal follows the winding (or the vn of the file) like the outward normal of a sphere,
+// shading faces it toward the ray (scatter_lambertian, direct_light).
+
+// Möller–Trumbore against triangle i, return t or -1, u and v receive the barycentrics of b and c
+static inline real mesh_hit_triangle(const mesh *m, size_t i, ray ry, real *u_out, real *v_out)
+{
+    STATS_INC(STAT_MESH_TRIANGLE_TESTS);
+    const uint32_t *idx = m->indices + 3 * i;
+    point a = m->vertices[idx[0]];
+    vec3 ab = vec3_sub(m->vertices[idx[1]], a);
+    vec3 ac = vec3_sub(m->vertices[idx[2]], a);
+    vec3 pvec = vec3_cross(ry.direction, ac);
+    real det = vec3_dot(ab, pvec);
+
+    if (fabs(det) < MESH_DET_EPSILON)
+        return -1.0;
+
+    real inv_det = REAL(1.0) / det;
+
+    vec3 tvec = vec3_sub(ry.origin, a);
+    real u = inv_det * vec3_dot(tvec, pvec);
+
+    if (u < REAL(0.0) || u > REAL(1.0))
+        return -1.0;
+
+    vec3 qvec = vec3_cross(tvec, ab);
+    real v = inv_det * vec3_dot(ry.direction, qvec);
+
+    if (v < REAL(0.0) || u + v > REAL(1.0))
+        return -1.0;
+
+    *u_out = u;
+    *v_out = v;
+    return inv_det * vec3_dot(ac, qvec);
+}
+
+static vec3 mesh_face_normal(const mesh *m, size_t i)
+{
+    const uint32_t *idx = m->indices + 3 * i;
+    point a = m->vertices[idx[0]];
+    return vec3_unit(vec3_cross(vec3_sub(m->vertices[idx[1]], a), vec3_sub(m->vertices[idx[2]], a)));
+}
+
+// interpolated vertex normal when the face has them, the face normal otherwise
+static vec3 mesh_normal(const mesh *m, size_t i, real u, real v)
+{
+    const uint32_t *n = m->normal_indices ? m->normal_indices + 3 * i : NULL;
+    if (n && n[0] != MESH_NO_NORMAL)
+    {
+        vec3 sum = vec3_add(vec3_scale(m->normals[n[0]], REAL(1.0) - u - v),
+                            vec3_add(vec3_scale(m->normals[n[1]], u), vec3_scale(m->normals[n[2]], v)));
+        real len = vec3_length(sum);
+        if (len > REAL(0.0))
+            return vec3_scale(sum, REAL(1.0) / len);
+    }
+    return mesh_face_normal(m, i);
+}
+
+static size_t mesh_hit_leaf(const void *ctx, const bvh_node *leaf, size_t node_index,
+                            ray r, hit_record_geometry *closest)
+{
+    const mesh *m = ctx;
+    size_t hit_index = BVH_NO_HIT;
+    real u, v;
+    for (size_t i = leaf->left_first; i < leaf->left_first + leaf->count; ++i)
+    {
+        real t = mesh_hit_triangle(m, i, r, &u, &v);
+        if (t >= HIT_EPSILON && (closest->t < REAL(0.0) || t < closest->t))
+        {
+            closest->t = t;
+            closest->r = r;
+            closest->normal = mesh_normal(m, i, u, v);
+            hit_index = i;
+        }
+    }
+    return hit_index;
+}
+
+static bool mesh_occluded_leaf(const void *ctx, const bvh_node *leaf, size_t node_index,
+                               ray r, real t_max)
+{
+    const mesh *m = ctx;
+    real u, v;
+    for (size_t i = leaf->left_first; i < leaf->left_first + leaf->count; ++i)
+    {
+        real t = mesh_hit_triangle(m, i, r, &u, &v);
+        if (t >= HIT_EPSILON && t <= t_max)
+            return true;
+    }
+    return false;
+}
+
+hit_record_geometry hit_mesh(mesh_ref *ref, ray ry)
+{
+    hit_record_geometry rec;
+    bvh_closest_hit(&ref->m->tree, ry, &rec, mesh_hit_leaf, ref->m);
+    return rec;
+}
+
+bool occluded_mesh(mesh_ref *ref, ray ry, real t_max)
+{
+    return bvh_any_hit(&ref->m->tree, ry, t_max, mesh_occluded_leaf, ref->m);
+}
+
+aabb bounds_mesh(mesh_ref *ref)
+{
+    return ref->m->tree.nodes[0].box;
+}
+
+// total area, the first call also builds the table sample_mesh picks triangles from.
+// build_scene_lights calls it for every light before rendering starts.
+real area_mesh(mesh_ref *ref)
+{
+    mesh *m = ref->m;
+    if (!m->area_cdf)
+    {
+        m->area_cdf = malloc(sizeof(real) * m->triangle_num);
+        real sum = 0.0;
+        for (size_t i = 0; i < m->triangle_num; ++i)
+        {
+            const uint32_t *idx = m->indices + 3 * i;
+            point a = m->vertices[idx[0]];
+            sum += REAL(0.5) * vec3_length(vec3_cross(vec3_sub(m->vertices[idx[1]], a), vec3_sub(m->vertices[idx[2]], a)));
+            m->area_cdf[i] = sum;
+        }
+    }
+    return m->area_cdf[m->triangle_num - 1];
+}
+
+// uniform point on the surface: a triangle by area, then a point on it.
+// normal receives the face normal, the side an emissive mesh lights (emitted_hit)
+point sample_mesh(mesh_ref *ref, unsigned int *state, vec3 *normal)
+{
+    const mesh *m = ref->m;
+    real target = rand_unit(state) * m->area_cdf[m->triangle_num - 1];
+    size_t lo = 0, hi = m->triangle_num - 1;
+    while (lo < hi)
+    {
+        size_t mid = (lo + hi) / 2;
+        if (m->area_cdf[mid] <= target)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    const uint32_t *idx = m->indices + 3 * lo;
+    point a = m->vertices[idx[0]];
+    vec3 ab = vec3_sub(m->vertices[idx[1]], a);
+    vec3 ac = vec3_sub(m->vertices[idx[2]], a);
+    real u = rand_unit(state);
+    real v = rand_unit(state);
+    if (u + v > REAL(1.0))
+    {
+        u = REAL(1.0) - u;
+        v = REAL(1.0) - v;
+    }
+    *normal = vec3_unit(vec3_cross(ab, ac));
+    return vec3_add(a, vec3_add(vec3_scale(ab, u), vec3_scale(ac, v)));
+}
+
+// ====== OBJ ======
+// v, vn and f are read, other statements (vt, o, g, s, usemtl, ...) are skipped.
+// faces are "a", "a/t", "a//n" or "a/t/n", negative indices count back from the last
+// vertex, and polygons are split into a fan of triangles.
+
+static void mesh_reserve(void **data, size_t *cap, size_t n, size_t elem)
+{
+    if (n <= *cap)
+        return;
+    size_t new_cap = *cap > 0 ? *cap : 1024;
+    while (new_cap < n)
+        new_cap *= 2;
+    void *p = realloc(*data, new_cap * elem);
+    if (!p)
+    {
+        perror("mesh");
+        exit(1);
+    }
+    *data = p;
+    *cap = new_cap;
+}
+
+// 1-based or negative index into count items, MESH_NO_NORMAL when it is out of range
+static uint32_t obj_index(long i, size_t count)
+{
+    if (i > 0 && (size_t)i <= count)
+        return (uint32_t)(i - 1);
+    if (i < 0 && (size_t)-i <= count)
+        return (uint32_t)(count + i);
+    return MESH_NO_NORMAL;
+}
+
+static void obj_error(const char *filename, size_t line_no, const char *what)
+{
+    fprintf(stderr, "%s:%zu: %s\n", filename, line_no, what);
+    exit(1);
+}
+
+static char *obj_read_file(const char *filename, size_t *size)
+{
+    FILE *f = fopen(filename, "rb");
+    if (!f)
+    {
+        perror(filename);
+        exit(1);
+    }
+    fseek(f, 0, SEEK_END);
+    long len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char *buf = malloc(len + 1);
+    if (!buf || fread(buf, 1, len, f) != (size_t)len)
+    {
+        perror(filename);
+        exit(1);
+    }
+    fclose(f);
+    buf[len] = '\0';
+    *size = len;
+    return buf;
+}
+
+static void mesh_load_obj(mesh *m, const char *filename)
+{
+    size_t size;
+    char *buf = obj_read_file(filename, &size);
+
+    size_t vertex_cap = 0, normal_cap = 0, triangle_cap = 0, normal_index_cap = 0;
+    m->vertex_num = m->normal_num = m->triangle_num = 0;
+    m->vertices = NULL;
+    m->normals = NULL;
+    m->indices = NULL;
+    m->normal_indices = NULL;
+    m->area_cdf = NULL;
+
+    size_t line_no = 0;
+    char *line = buf;
+    while (line < buf + size)
+    {
+        // cut the line so that strtod and strtol stop at its end
+        char *end = memchr(line, '\n', buf + size - line);
+        if (!end)
+            end = buf + size;
+        *end = '\0';
+        line_no++;
+
+        char *p = line;
+        while (*p == ' ' || *p == '\t')
+            p++;
+
+        if (p[0] == 'v' && (p[1] == ' ' || p[1] == '\t'))
+        {
+            char *q;
+            real c[3];
+            p++;
+            for (int k = 0; k < 3; ++k, p = q)
+            {
+                c[k] = strtod(p, &q);
+                if (q == p)
+                    obj_error(filename, line_no, "bad vertex");
+            }
+            mesh_reserve((void **)&m->vertices, &vertex_cap, m->vertex_num + 1, sizeof(point));
+            m->vertices[m->vertex_num++] = vec3_make(c[0], c[1], c[2]);
+        }
+        else if (p[0] == 'v' && p[1] == 'n' && (p[2] == ' ' || p[2] == '\t'))
+        {
+            char *q;
+            real c[3];
+            p += 2;
+            for (int k = 0; k < 3; ++k, p = q)
+            {
+                c[k] = strtod(p, &q);
+                if (q == p)
+                    obj_error(filename, line_no, "bad normal");
+            }
+            mesh_reserve((void **)&m->normals, &normal_cap, m->normal_num + 1, sizeof(vec3));
+            m->normals[m->normal_num++] = vec3_make(c[0], c[1], c[2]);
+        }
+        else if (p[0] == 'f' && (p[1] == ' ' || p[1] == '\t'))
+        {
+            uint32_t first_v = 0, first_n = 0, prev_v = 0, prev_n = 0;
+            int corners = 0;
+            p++;
+            for (;;)
+            {
+                while (*p == ' ' || *p == '\t' || *p == '\r')
+                    p++;
+                if (*p == '\0')
+                    break;
+
+                char *q;
+                long vi = strtol(p, &q, 10);
+                long ni = 0;
+                if (q == p)
+                    obj_error(filename, line_no, "bad face");
+                p = q;
+                if (*p == '/')
+                {
+                    p++;
+                    if (*p != '/')
+                        strtol(p, &p, 10); // texture coordinates are not used
+                    if (*p == '/')
+                        ni = strtol(p + 1, &p, 10);
+                }
+
+                uint32_t v = obj_index(vi, m->vertex_num);
+                uint32_t n = ni != 0 ? obj_index(ni, m->normal_num) : MESH_NO_NORMAL;
+                if (v == MESH_NO_NORMAL || (ni != 0 && n == MESH_NO_NORMAL))
+                    obj_error(filename, line_no, "face index out of range");
+
+                if (corners == 0)
+                {
+                    first_v = v;
+                    first_n = n;
+                }
+                else if (corners >= 2)
+                {
+                    size_t t = m->triangle_num++;
+                    mesh_reserve((void **)&m->indices, &triangle_cap, 3 * m->triangle_num, sizeof(uint32_t));
+                    m->indices[3 * t] = first_v;
+                    m->indices[3 * t + 1] = prev_v;
+                    m->indices[3 * t + 2] = v;
+
+                    mesh_reserve((void **)&m->normal_indices, &normal_index_cap, 3 * m->triangle_num, sizeof(uint32_t));
+                    bool has_normals = first_n != MESH_NO_NORMAL && prev_n != MESH_NO_NORMAL && n != MESH_NO_NORMAL;
+                    m->normal_indices[3 * t] = has_normals ? first_n : MESH_NO_NORMAL;
+                    m->normal_indices[3 * t + 1] = has_normals ? prev_n : MESH_NO_NORMAL;
+                    m->normal_indices[3 * t + 2] = has_normals ? n : MESH_NO_NORMAL;
+                }
+                prev_v = v;
+                prev_n = n;
+                corners++;
+            }
+            if (corners < 3)
+                obj_error(filename, line_no, "face with less than 3 vertices");
+        }
+
+        line = end + 1;
+    }
+    free(buf);
+
+    if (m->triangle_num == 0)
+        obj_error(filename, line_no, "no faces");
+    if (m->normal_num == 0)
+    {
+        free(m->normal_indices);
+        m->normal_indices = NULL;
+    }
+}
+
+// build the triangle hierarchy and store the triangles in leaf order
+static void mesh_build_bvh(mesh *m)
+{
+    aabb *bounds = malloc(sizeof(aabb) * m->triangle_num);
+    for (size_t i = 0; i < m->triangle_num; ++i)
+    {
+        const uint32_t *idx = m->indices + 3 * i;
+        aabb box = aabb_extend(aabb_empty(), m->vertices[idx[0]]);
+        box = aabb_extend(box, m->vertices[idx[1]]);
+        bounds[i] = aabb_extend(box, m->vertices[idx[2]]);
+    }
+    bvh_build(&m->tree, bounds, m->triangle_num);
+    free(bounds);
+
+    uint32_t *lists[2] = {m->indices, m->normal_indices};
+    for (int l = 0; l < 2; ++l)
+    {
+        if (!lists[l])
+            continue;
+        uint32_t *sorted = malloc(sizeof(uint32_t) * 3 * m->triangle_num);
+        for (size_t i = 0; i < m->triangle_num; ++i)
+        {
+            memcpy(sorted + 3 * i, lists[l] + 3 * m->tree.index[i], sizeof(uint32_t) * 3);
+        }
+        free(lists[l]);
+        lists[l] = sorted;
+    }
+    m->indices = lists[0];
+    m->normal_indices = lists[1];
+
+    // the permutation is not needed once the triangles are sorted
+    free(m->tree.index);
+    m->tree.index = NULL;
+}
+
+// ====== mesh table ======
+
+static mesh **MESH_TABLE;
+static size_t MESH_TABLE_NUM;
+static bool mesh_quiet = false; // no load line per mesh
+
+// the mesh loaded from filename, read and built on the first request
+mesh *mesh_get(const char *filename)
+{
+    for (size_t i = 0; i < MESH_TABLE_NUM; ++i)
+    {
+        if (strcmp(MESH_TABLE[i]->name, filename) == 0)
+            return MESH_TABLE[i];
+    }
+    if (strlen(filename) >= MESH_NAME_LEN)
+    {
+        fprintf(stderr, "mesh file name too long: %s\n", filename);
+        exit(1);
+    }
+
+    struct timeval t1, t2;
+    gettimeofday(&t1, NULL);
+
+    mesh *m = malloc(sizeof(mesh));
+    strcpy(m->name, filename);
+    mesh_load_obj(m, filename);
+    gettimeofday(&t2, NULL);
+    mesh_build_bvh(m);
+
+    if (!mesh_quiet)
+        printf("mesh: %s, %zu vertices, %zu normals, %zu triangles, load %f sec, bvh %f sec\n",
+               m->name, m->vertex_num, m->normal_num, m->triangle_num,
+               time_diff_sec(t1, t2), m->tree.stats.build_sec);
+
+    MESH_TABLE = realloc(MESH_TABLE, sizeof(mesh *) * (MESH_TABLE_NUM + 1));
+    MESH_TABLE[MESH_TABLE_NUM++] = m;
+    return m;
+}
+
+#endif
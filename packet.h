@@ -0,0 +1,132 @@
+#ifndef PACKET_H
+#define PACKET_H
+
+// 近くのピクセルの ray をまとめて (packet) 一緒に BVH を辿る。
+// ノードの箱は全レーンまとめて判定し、どのレーンも当たらなければその部分木を飛ばす。
+// レーンごとの active で、途中で抜けた ray (背景に当たった ray など) を外す。
+
+#include <stdbool.h>
+#include "vec3.h"
+#include "component.h"
+#include "bvh.h"
+
+#define PACKET_MAX 64 // up to 8x8 rays
+
+// lanes are kept as separate arrays so that the box test vectorizes
+typedef struct
+{
+    size_t n;
+    real ox[PACKET_MAX], oy[PACKET_MAX], oz[PACKET_MAX];
+    real inv_dx[PACKET_MAX], inv_dy[PACKET_MAX], inv_dz[PACKET_MAX];
+    real t_max[PACKET_MAX]; // -INFINITY for inactive lanes so that they never hit
+} packet_lanes;
+
+// slab test of every lane, return the number of lanes that hit
+static inline size_t packet_hit_aabb(const packet_lanes *p, const aabb *box, bool lane_hit[PACKET_MAX])
+{
+    size_t hit_num = 0;
+    for (size_t k = 0; k < p->n; ++k)
+    {
+        real tx1 = (box->min.x - p->ox[k]) * p->inv_dx[k];
+        real tx2 = (box->max.x - p->ox[k]) * p->inv_dx[k];
+        real tmin = min_real(tx1, tx2);
+        real tmax = max_real(tx1, tx2);
+
+        real ty1 = (box->min.y - p->oy[k]) * p->inv_dy[k];
+        real ty2 = (box->max.y - p->oy[k]) * p->inv_dy[k];
+        tmin = max_real(tmin, min_real(ty1, ty2));
+        tmax = min_real(tmax, max_real(ty1, ty2));
+
+        real tz1 = (box->min.z - p->oz[k]) * p->inv_dz[k];
+        real tz2 = (box->max.z - p->oz[k]) * p->inv_dz[k];
+        tmin = max_real(tmin, min_real(tz1, tz2));
+        tmax = min_real(tmax, max_real(tz1, tz2));
+
+        // no short circuit so that the loop stays branch free
+        lane_hit[k] = (tmax >= max_real(tmin, 0.0)) & (tmin <= p->t_max[k]);
+        hit_num += lane_hit[k];
+    }
+    return hit_num;
+}
+
+// closest hit of every active lane, same result as calling bvh_closest_hit per lane
+// closest[k] and hit_index[k] are only meaningful for active lanes
+static inline void bvh_closest_hit_packet(const bvh *b, const ray *rays, const bool *active, size_t n,
+                                          hit_record_geometry *closest, size_t *hit_index,
+                                          bvh_hit_leaf_fn hit_leaf, const void *ctx)
+{
+    assert(n <= PACKET_MAX);
+
+    packet_lanes p;
+    p.n = n;
+    int first_active = -1;
+    for (size_t k = 0; k < n; ++k)
+    {
+        closest[k].t = -1.0;
+        hit_index[k] = BVH_NO_HIT;
+        p.ox[k] = rays[k].origin.x;
+        p.oy[k] = rays[k].origin.y;
+        p.oz[k] = rays[k].origin.z;
+        p.inv_dx[k] = REAL(1.0) / rays[k].direction.x;
+        p.inv_dy[k] = REAL(1.0) / rays[k].direction.y;
+        p.inv_dz[k] = REAL(1.0) / rays[k].direction.z;
+        p.t_max[k] = active[k] ? INFINITY : -INFINITY;
+        if (active[k] && first_active < 0)
+            first_active = k;
+    }
+    if (first_active < 0 || b->prim_num == 0)
+        return;
+
+    // children are ordered by the direction of one representative ray
+    vec3 dir = rays[first_active].direction;
+
+    uint32_t stack[BVH_STACK_SIZE];
+    int sp = 0;
+    stack[sp++] = 0;
+
+    bool lane_hit[PACKET_MAX];
+    while (sp > 0)
+    {
+        uint32_t node_index = stack[--sp];
+        const bvh_node *node = &b->nodes[node_index];
+
+        if (packet_hit_aabb(&p, &node->box, lane_hit) == 0)
+            continue;
+
+        if (bvh_is_leaf(node))
+        {
+            for (size_t k = 0; k < n; ++k)
+            {
+                if (!lane_hit[k])
+                    continue;
+                size_t leaf_hit = hit_leaf(ctx, node, node_index, rays[k], &closest[k]);
+                if (leaf_hit != BVH_NO_HIT)
+                {
+                    hit_index[k] = leaf_hit;
+                    p.t_max[k] = closest[k].t;
+                }
+            }
+            continue;
+        }
+
+        // visit the child nearer along the axis where the children are furthest apart first
+        const bvh_node *left = &b->nodes[node->left_first];
+        const bvh_node *right = &b->nodes[node->left_first + 1];
+        vec3 d = vec3_sub(aabb_centroid(right->box), aabb_centroid(left->box));
+        real ax = fabs(d.x), ay = fabs(d.y), az = fabs(d.z);
+        real along = ax >= ay && ax >= az ? d.x * dir.x : ay >= az ? d.y * dir.y : d.z * dir.z;
+
+        if (along >= REAL(0.0))
+        {
+            stack[sp++] = node->left_first + 1;
+            stack[sp++] = node->left_first;
+        }
+        else
+        {
+            stack[sp++] = node->left_first;
+            stack[sp++] = node->left_first + 1;
+        }
+    }
+}
+
+#endif
@@ -6,29 +6,81 @@
 #include <stdbool.h>
 #include "vec3.h"
 #include "component.h"
+#include "mesh.h"
+#include "transform.h"
 
-#define SCENE_FILENAME "scene.txt"
+#define PARSE_NAME_LEN 64
 
+// a shape named by "define NAME <shape> { ... }" and placed by instance lines
 typedef struct
 {
+    char name[PARSE_NAME_LEN];
     geometry_type geo_type;
     sphere sph;
     triangle tri;
+    mesh_ref msh;
+    void *built; // the renderer's geometry for it, made by the scene on first use
+} parse_definition;
+
+typedef struct
+{
+    geometry_type geo_type;
+    sphere sph;
+    triangle tri;
+    mesh_ref msh;
+    parse_definition *inst_def; // INSTANCE: the placed shape and its placement
+    affine inst_xf;
     material_type mat_type;
     lambertian lam;
     metal met;
     dielectric die;
+    emissive emi;
 } result;
 
 static FILE *parse_fp = NULL;
+static bool parse_quiet = false; // no log line per object
+
+#define parse_log(...)           \
+    do                           \
+    {                            \
+        if (!parse_quiet)        \
+            printf(__VA_ARGS__); \
+    } while (0)
+
+static char parse_dir[MESH_NAME_LEN]; // directory of the scene file, mesh files are relative to it
+static parse_definition **parse_defs = NULL;
+static size_t parse_def_num = 0;
+
+// read up to n numbers separated by spaces, return how many were read
+static int parse_reals(const char *str, real *out, int n)
+{
+    int i = 0;
+    for (; i < n; ++i)
+    {
+        char *end;
+        double v = strtod(str, &end);
+        if (end == str)
+            break;
+        out[i] = v;
+        str = end;
+    }
+    return i;
+}
 
-size_t setup_file() {
-    parse_fp = fopen(SCENE_FILENAME, "r");
+size_t setup_file(const char *filename) {
+    parse_fp = fopen(filename, "r");
     if (!parse_fp) {
-        perror("fopen");
+        perror(filename);
         exit(1);
     }
 
+    const char *slash = strrchr(filename, '/');
+    size_t dir_len = slash ? (size_t)(slash - filename) + 1 : 0;
+    if (dir_len >= sizeof(parse_dir))
+        dir_len = 0;
+    memcpy(parse_dir, filename, dir_len);
+    parse_dir[dir_len] = '\0';
+
     char line[512];
     if (!fgets(line, sizeof(line), parse_fp)) {
         fprintf(stderr, "failed to read object count\n");
@@ -39,90 +91,272 @@ size_t setup_file() {
     return count;
 }
 
-bool parse_line(result *res) {
-    if (!parse_fp) return false;
-
-    char line[512];
-    if (!fgets(line, sizeof(line), parse_fp)) return false;
-
-    char kind[32], shape_block[256];
-    char material[32], mat_block[256];
+// mesh file relative to the scene file unless it is absolute
+static mesh *parse_mesh(const char *file)
+{
+    char path[2 * MESH_NAME_LEN];
+    snprintf(path, sizeof(path), "%s%s", file[0] == '/' ? "" : parse_dir, file);
+    return mesh_get(path);
+}
 
-    int matched = sscanf(line, "%31s { %255[^}] } %31s { %255[^}] }",
-                         kind, shape_block, material, mat_block);
+static parse_definition *parse_add_definition(const char *name)
+{
+    if (strlen(name) >= PARSE_NAME_LEN)
+    {
+        printf("name too long: %s\n", name);
+        exit(1);
+    }
+    parse_definition *def = calloc(1, sizeof(parse_definition));
+    strcpy(def->name, name);
+    parse_defs = realloc(parse_defs, sizeof(parse_definition *) * (parse_def_num + 1));
+    parse_defs[parse_def_num++] = def;
+    return def;
+}
 
-    if (matched != 4)
+// a defined name, or an obj file that is defined as a mesh on first use
+static parse_definition *parse_find_definition(const char *name)
+{
+    for (size_t i = 0; i < parse_def_num; ++i)
     {
-        printf("parse error: %s\n", line);
+        if (strcmp(parse_defs[i]->name, name) == 0)
+            return parse_defs[i];
+    }
+    size_t len = strlen(name);
+    if (len < 4 || strcmp(name + len - 4, ".obj") != 0)
+    {
+        printf("unknown shape name: %s\n", name);
         exit(1);
     }
+    parse_definition *def = parse_add_definition(name);
+    def->geo_type = MESH;
+    def->msh.m = parse_mesh(name);
+    return def;
+}
 
+// fill the geometry part of res from "kind { shape_block }"
+static void parse_shape(const char *kind, const char *shape_block, const char *line, result *res)
+{
     if (strcmp(kind, "sphere") == 0)
     {
         sphere s;
-        sscanf(shape_block, "%lf %lf %lf %lf",
-               &s.center.x, &s.center.y, &s.center.z, &s.radius);
-        printf("sphere: center(%lf, %lf, %lf), radius(%lf)\n",
-               s.center.x, s.center.y, s.center.z, s.radius);
+        real v[4];
+        if (parse_reals(shape_block, v, 4) != 4)
+        {
+            printf("parse error: %s\n", line);
+            exit(1);
+        }
+        s.center = vec3_make(v[0], v[1], v[2]);
+        s.radius = v[3];
+        parse_log("sphere: center(%lf, %lf, %lf), radius(%lf)\n",
+               (double)s.center.x, (double)s.center.y, (double)s.center.z, (double)s.radius);
         res->geo_type = SPHERE;
         res->sph = s;
     }
     else if (strcmp(kind, "triangle") == 0)
     {
         triangle t;
-        sscanf(shape_block, "%lf %lf %lf %lf %lf %lf %lf %lf %lf",
-               &t.a.x, &t.a.y, &t.a.z,
-               &t.b.x, &t.b.y, &t.b.z,
-               &t.c.x, &t.c.y, &t.c.z);
-        printf("triangle: a(%lf, %lf, %lf), b(%lf, %lf, %lf), c(%lf, %lf, %lf)\n",
-               t.a.x, t.a.y, t.a.z,
-               t.b.x, t.b.y, t.b.z,
-               t.c.x, t.c.y, t.c.z);
+        real v[9];
+        if (parse_reals(shape_block, v, 9) != 9)
+        {
+            printf("parse error: %s\n", line);
+            exit(1);
+        }
+        t.a = vec3_make(v[0], v[1], v[2]);
+        t.b = vec3_make(v[3], v[4], v[5]);
+        t.c = vec3_make(v[6], v[7], v[8]);
+        parse_log("triangle: a(%lf, %lf, %lf), b(%lf, %lf, %lf), c(%lf, %lf, %lf)\n",
+               (double)t.a.x, (double)t.a.y, (double)t.a.z,
+               (double)t.b.x, (double)t.b.y, (double)t.b.z,
+               (double)t.c.x, (double)t.c.y, (double)t.c.z);
         res->geo_type = TRIANGLE;
         res->tri = t;
     }
+    else if (strcmp(kind, "mesh") == 0)
+    {
+        // mesh { file.obj }, an absolute path or one relative to the scene file
+        char file[256];
+        if (sscanf(shape_block, "%255s", file) != 1)
+        {
+            printf("parse error: %s\n", line);
+            exit(1);
+        }
+        res->geo_type = MESH;
+        res->msh.m = parse_mesh(file);
+    }
+    else if (strcmp(kind, "instance") == 0)
+    {
+        // instance { NAME tx ty tz [scale [yaw]] } or instance { NAME m00 m01 ... m23 },
+        // NAME is a define or an obj file, the 12 numbers are the rows of a 3x4 matrix
+        char name[PARSE_NAME_LEN];
+        int used;
+        real v[12];
+        if (sscanf(shape_block, "%63s%n", name, &used) != 1)
+        {
+            printf("parse error: %s\n", line);
+            exit(1);
+        }
+        int n = parse_reals(shape_block + used, v, 12);
+        affine xf;
+        if (n == 12)
+        {
+            for (int i = 0; i < 3; ++i)
+                for (int j = 0; j < 4; ++j)
+                    xf.m[i][j] = v[4 * i + j];
+        }
+        else if (n >= 3 && n <= 5)
+        {
+            xf = affine_place(vec3_make(v[0], v[1], v[2]), n >= 4 ? v[3] : REAL(1.0), n == 5 ? v[4] : REAL(0.0));
+        }
+        else
+        {
+            printf("parse error: %s\n", line);
+            exit(1);
+        }
+        affine inv;
+        if (!affine_inverse(&xf, &inv))
+        {
+            printf("singular transform: %s\n", line);
+            exit(1);
+        }
+        parse_log("instance: %s, translate(%lf, %lf, %lf)\n", name, (double)xf.m[0][3], (double)xf.m[1][3], (double)xf.m[2][3]);
+        res->geo_type = INSTANCE;
+        res->inst_def = parse_find_definition(name);
+        res->inst_xf = xf;
+    }
     else
     {
         printf("unknown shape: %s\n", kind);
         exit(1);
     }
 
+}
+
+bool parse_line(result *res) {
+    if (!parse_fp) return false;
+
+    char line[512];
+    char kind[32], shape_block[256];
+    char material[32], mat_block[256];
+    for (;;)
+    {
+        if (!fgets(line, sizeof(line), parse_fp)) return false;
+
+        // define NAME <shape> { ... }, only names a shape for instance lines
+        char name[PARSE_NAME_LEN];
+        if (sscanf(line, "define %63s %31s { %255[^}] }", name, kind, shape_block) == 3)
+        {
+            if (strcmp(kind, "instance") == 0)
+            {
+                printf("parse error: %s\n", line);
+                exit(1);
+            }
+            for (size_t i = 0; i < parse_def_num; ++i)
+            {
+                if (strcmp(parse_defs[i]->name, name) == 0)
+                {
+                    printf("defined twice: %s\n", name);
+                    exit(1);
+                }
+            }
+            result shape;
+            parse_log("define %s: ", name);
+            parse_shape(kind, shape_block, line, &shape);
+            parse_definition *def = parse_add_definition(name);
+            def->geo_type = shape.geo_type;
+            def->sph = shape.sph;
+            def->tri = shape.tri;
+            def->msh = shape.msh;
+            continue;
+        }
+        break;
+    }
+
+    int matched = sscanf(line, "%31s { %255[^}] } %31s { %255[^}] }",
+                         kind, shape_block, material, mat_block);
+
+    if (matched != 4)
+    {
+        printf("parse error: %s\n", line);
+        exit(1);
+    }
+
+    parse_shape(kind, shape_block, line, res);
+
     if (strcmp(material, "lambertian") == 0)
     {
         lambertian l;
-        sscanf(mat_block, "%lf %lf %lf",
-               &l.albedo.x, &l.albedo.y, &l.albedo.z);
-        printf("--lambertian: albedo(%lf, %lf, %lf)\n",
-               l.albedo.x, l.albedo.y, l.albedo.z);
+        real v[3];
+        if (parse_reals(mat_block, v, 3) != 3)
+        {
+            printf("parse error: %s\n", line);
+            exit(1);
+        }
+        l.albedo = vec3_make(v[0], v[1], v[2]);
+        parse_log("--lambertian: albedo(%lf, %lf, %lf)\n",
+               (double)l.albedo.x, (double)l.albedo.y, (double)l.albedo.z);
         res->mat_type = LAMBERTIAN;
         res->lam = l;
     }
     else if (strcmp(material, "metal") == 0)
     {
         metal m;
-        sscanf(mat_block, "%lf %lf %lf %lf",
-               &m.col.x, &m.col.y, &m.col.z, &m.fuzz);
-        printf("--metal: col(%lf, %lf, %lf), fuzz(%lf)\n",
-               m.col.x, m.col.y, m.col.z, m.fuzz);
+        real v[4];
+        if (parse_reals(mat_block, v, 4) != 4)
+        {
+            printf("parse error: %s\n", line);
+            exit(1);
+        }
+        m.col = vec3_make(v[0], v[1], v[2]);
+        m.fuzz = v[3];
+        parse_log("--metal: col(%lf, %lf, %lf), fuzz(%lf)\n",
+               (double)m.col.x, (double)m.col.y, (double)m.col.z, (double)m.fuzz);
         res->mat_type = METAL;
         res->met = m;
     }
     else if (strcmp(material, "dielectric") == 0)
     {
         dielectric d;
-        sscanf(mat_block, "%lf %lf %lf %lf",
-               &d.albedo.x, &d.albedo.y, &d.albedo.z, &d.ref_idx);
-        printf("--dielectric: albedo(%lf, %lf, %lf)  ref(%lf)\n",
-               d.albedo.x, d.albedo.y, d.albedo.z, d.ref_idx);
+        real v[4];
+        if (parse_reals(mat_block, v, 4) != 4)
+        {
+            printf("parse error: %s\n", line);
+            exit(1);
+        }
+        d.albedo = vec3_make(v[0], v[1], v[2]);
+        d.ref_idx = v[3];
+        parse_log("--dielectric: albedo(%lf, %lf, %lf)  ref(%lf)\n",
+               (double)d.albedo.x, (double)d.albedo.y, (double)d.albedo.z, (double)d.ref_idx);
         res->mat_type = DIELECTRIC;
         res->die = d;
     }
+    else if (strcmp(material, "emissive") == 0)
+    {
+        emissive e;
+        real v[3];
+        if (parse_reals(mat_block, v, 3) != 3)
+        {
+            printf("parse error: %s\n", line);
+            exit(1);
+        }
+        e.emit = vec3_make(v[0], v[1], v[2]);
+        parse_log("--emissive: emit(%lf, %lf, %lf)\n",
+               (double)e.emit.x, (double)e.emit.y, (double)e.emit.z);
+        res->mat_type = EMISSIVE;
+        res->emi = e;
+    }
     else
     {
         printf("unknown material: %s\n", material);
         exit(1);
     }
 
+    // light sampling scales the area of an instance by one factor, which only a uniform scale gives
+    if (res->geo_type == INSTANCE && res->mat_type == EMISSIVE && !affine_is_similarity(&res->inst_xf))
+    {
+        printf("emissive instance needs a uniform scale: %s\n", line);
+        exit(1);
+    }
+
     return true;
 }
 
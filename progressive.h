@@ -0,0 +1,195 @@
+#ifndef PROGRESSIVE_H
+#define PROGRESSIVE_H
+
+// サンプルを何回かのパスに分けて足し込んでいく描画。
+// framebuffer には各ピクセルのサンプルの和を持ち、パスごとに checkpoint に保存する。
+// 乱数はピクセルとサンプル番号から決まる (sample_seed) ので、保存が要るのは和と済んだサンプル数だけで、
+// 途中から再開しても一度に描いたときと同じ画像になる。
+// adaptive sampling のときはピクセルごとのサンプル数と分散も一緒に保存する。
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include "utils.h"
+#include "config.h"
+#include "image.h"
+#include "adaptive.h"
+
+// add samples [sample_begin, sample_end) of every pixel to the sums in image
+typedef void (*render_pass_func)(framebuffer *image, int sample_begin, int sample_end, ppm_stream *stream);
+
+#define CHECKPOINT_MAGIC "RTCKPT3" // change it with the layout of checkpoint_header, 2: adaptive, 3: scene and integrator
+
+typedef struct
+{
+    char magic[8];
+    uint32_t real_size; // sizeof(real), float and double checkpoints do not mix
+    int32_t width, height;
+    int32_t max_depth;
+    uint32_t frame;
+    uint32_t seed;
+    int32_t samples_done;
+    int32_t adaptive; // pixel_variance of every pixel follows the sums
+    int32_t integrator, nee, rr_depth;
+    char scene[CONFIG_PATH_LEN];
+    int64_t scene_size, scene_mtime; // the scene file when the render started, an edited scene does not resume
+} checkpoint_header;
+
+static checkpoint_header checkpoint_make_header(int samples_done)
+{
+    checkpoint_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, CHECKPOINT_MAGIC, sizeof(h.magic));
+    h.real_size = sizeof(real);
+    h.width = CONFIG.width;
+    h.height = CONFIG.height;
+    h.max_depth = CONFIG.max_depth;
+    h.frame = CONFIG.frame;
+    h.seed = RANDOM_SEED_GLOBAL;
+    h.samples_done = samples_done;
+    h.adaptive = ADAPTIVE.enabled;
+    h.integrator = CONFIG.integrator;
+    h.nee = CONFIG.nee;
+    h.rr_depth = CONFIG.rr_depth;
+    memcpy(h.scene, CONFIG.scene, sizeof(h.scene));
+    struct stat st;
+    if (stat(CONFIG.scene, &st) == 0)
+    {
+        h.scene_size = st.st_size;
+        h.scene_mtime = st.st_mtime;
+    }
+    return h;
+}
+
+// write to a temporary file first so a crash never leaves a broken checkpoint
+void checkpoint_save(const char *filename, framebuffer *sums, int samples_done)
+{
+    char tmp[CONFIG_PATH_LEN + 8];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", filename);
+
+    FILE *f = fopen(tmp, "wb");
+    if (!f)
+    {
+        perror(tmp);
+        exit(1);
+    }
+    checkpoint_header h = checkpoint_make_header(samples_done);
+    size_t n = (size_t)sums->width * sums->height;
+    if (fwrite(&h, sizeof(h), 1, f) != 1 || fwrite(sums->pixels, sizeof(color), n, f) != n ||
+        (ADAPTIVE.enabled && fwrite(ADAPTIVE.pixels, sizeof(pixel_variance), n, f) != n) || fclose(f) != 0)
+    {
+        perror(tmp);
+        exit(1);
+    }
+    if (rename(tmp, filename) != 0)
+    {
+        perror(filename);
+        exit(1);
+    }
+}
+
+// return the samples already in the checkpoint, 0 when there is no checkpoint yet
+int checkpoint_load(const char *filename, framebuffer *sums)
+{
+    FILE *f = fopen(filename, "rb");
+    if (!f)
+    {
+        if (errno == ENOENT)
+            return 0;
+        perror(filename);
+        exit(1);
+    }
+
+    checkpoint_header h;
+    checkpoint_header expected = checkpoint_make_header(0);
+    size_t n = (size_t)sums->width * sums->height;
+    if (fread(&h, sizeof(h), 1, f) != 1 || memcmp(h.magic, expected.magic, sizeof(h.magic)) != 0)
+    {
+        fprintf(stderr, "%s: not a checkpoint\n", filename);
+        exit(1);
+    }
+    if (h.real_size != expected.real_size || h.width != expected.width || h.height != expected.height ||
+        h.max_depth != expected.max_depth || h.frame != expected.frame || h.seed != expected.seed ||
+        h.adaptive != expected.adaptive)
+    {
+        fprintf(stderr, "%s: made with other settings (%dx%d, depth %d, frame %u, %u byte real, adaptive %d)\n",
+                filename, h.width, h.height, h.max_depth, h.frame, h.real_size, h.adaptive);
+        exit(1);
+    }
+    if (h.integrator != expected.integrator || h.nee != expected.nee || h.rr_depth != expected.rr_depth)
+    {
+        fprintf(stderr, "%s: made with another integrator (%s, nee %d, rr_depth %d)\n", filename,
+                h.integrator == INTEGRATOR_FORWARD ? "forward" : "backward", h.nee, h.rr_depth);
+        exit(1);
+    }
+    h.scene[CONFIG_PATH_LEN - 1] = '\0';
+    if (strcmp(h.scene, expected.scene) != 0 || h.scene_size != expected.scene_size ||
+        h.scene_mtime != expected.scene_mtime)
+    {
+        fprintf(stderr, "%s: made from another scene (%s) or the scene file changed since\n", filename, h.scene);
+        exit(1);
+    }
+    if (h.samples_done < 0 || fread(sums->pixels, sizeof(color), n, f) != n ||
+        (ADAPTIVE.enabled && fread(ADAPTIVE.pixels, sizeof(pixel_variance), n, f) != n))
+    {
+        fprintf(stderr, "%s: truncated\n", filename);
+        exit(1);
+    }
+    fclose(f);
+    return h.samples_done;
+}
+
+// render CONFIG.samples samples per pixel in passes of CONFIG.pass samples,
+// leave the mean in image and return the samples per pixel in it
+// (the most any pixel took with adaptive sampling)
+int render_progressive(framebuffer *image, ppm_stream *stream, render_pass_func render_pass)
+{
+    adaptive_init(image->width, image->height, CONFIG.noise > 0.0);
+
+    int done = 0;
+    if (CONFIG.resume)
+    {
+        done = checkpoint_load(CONFIG.checkpoint, image);
+        if (done > 0)
+            printf("resume from %s, %d samples done\n", CONFIG.checkpoint, done);
+    }
+
+    int pass = CONFIG.pass > 0 ? CONFIG.pass : CONFIG.samples;
+    while (done < CONFIG.samples)
+    {
+        int next = CONFIG.samples - done > pass ? done + pass : CONFIG.samples;
+        if (stream)
+            stream->scale = 1.0 / next;
+        render_pass(image, done, next, stream);
+        done = next;
+
+        if (CONFIG.checkpoint[0] != '\0')
+        {
+            checkpoint_save(CONFIG.checkpoint, image, done);
+            printf("checkpoint %d / %d samples\n", done, CONFIG.samples);
+        }
+    }
+
+    if (ADAPTIVE.enabled)
+    {
+        adaptive_report(done);
+        for (int row = 0; row < image->height; ++row)
+            for (int x = 0; x < image->width; ++x)
+            {
+                int n = adaptive_samples(x, row, done);
+                if (n > 0)
+                    *framebuffer_at(image, x, row) = vec3_scale(*framebuffer_at(image, x, row), 1.0 / n);
+            }
+    }
+    else if (done > 0)
+    {
+        framebuffer_scale(image, 1.0 / done);
+    }
+    adaptive_free();
+    return done;
+}
+
+#endif
@@ -4,38 +4,48 @@
 #include "vec3.h"
 #include "world_entity_comb.h"
 #include "scene_comb.h"
+#include "config.h"
+#include "image.h"
+#include "progressive.h"
 
-color ray_color(ray r, unsigned int *state)
+// max_depth is a constant in the fast paths of ray_color, so the loop and hit_mat get specialized
+static inline color ray_color_depth(ray r, unsigned int *state, const int max_depth)
 {
-    material_union hit_mat[MAX_REFLECTION_DEPTH];
+    material_union hit_mat[max_depth];
 
     int reflection_depth = 0;
+    size_t light = BVH_NO_HIT;
+    hit_record_geometry light_rec = {0};
 
-    for (reflection_depth = 0; reflection_depth < MAX_REFLECTION_DEPTH; ++reflection_depth)
+    for (reflection_depth = 0; reflection_depth < max_depth; ++reflection_depth)
     {
-        hit_record_geometry closest = {.t = -1.0};
+        size_t hit_index;
+        hit_record_geometry closest = hit_scene(r, &hit_index);
 
-        for (size_t i = 0; i < ENTITY_NUM; ++i)
+        if (closest.t < REAL(0.0))
         {
-            hit_record_geometry rec = hit_geometry(ENTITY[i].geo, r);
-            if (hit_record_closer(&closest, rec))
-            {
-                hit_mat[reflection_depth] = ENTITY[i].mat;
-            }
+            // no hit
+            STATS_INC(STAT_ESCAPES);
+            break;
         }
-
-        if (closest.t < 0.0)
+        else if (is_emissive_material(*entity_material(hit_index)))
         {
-            // no hit
+            // the path ends on a light
+            STATS_INC(STAT_EMISSIVE_HITS);
+            light = hit_index;
+            light_rec = closest;
             break;
         }
         else
         {
+            STATS_INC(STAT_METAL_HITS + material_type_of(*entity_material(hit_index)));
+            hit_mat[reflection_depth] = *entity_material(hit_index);
             r = scatter_material(hit_mat[reflection_depth], closest, state);
         }
     }
 
-    color pixel_color = background_color(r);
+    STATS_PATH(reflection_depth < max_depth ? reflection_depth + 1 : max_depth);
+    color pixel_color = light != BVH_NO_HIT ? emitted_hit(*entity_material(light), light_rec) : background_color(r);
 
     // compute color by reverse order
     for (int i = reflection_depth - 1; i >= 0; --i)
@@ -46,31 +56,116 @@ color ray_color(ray r, unsigned int *state)
     return pixel_color;
 }
 
-void render(color image[HEIGHT][WIDTH])
+// forward integrator: the throughput is carried along the path instead of replaying hit_mat,
+// and after CONFIG.rr_depth bounces Russian roulette ends paths with little throughput left,
+// so CONFIG.max_depth (CONFIG_MAX_DEPTH unless --depth is given) only bounds the rare long path.
+// with CONFIG.nee, diffuse hits also take direct light through a shadow ray (direct_light);
+// a light reached by the bounce after such a hit is then not counted again.
+color ray_color_forward(ray r, unsigned int *state)
 {
-    struct timeval t1, t2;
+    color radiance = vec3_make(0.0, 0.0, 0.0);
+    color throughput = color_make(1.0, 1.0, 1.0);
+    real weight = 1.0; // 1 / survival probability of the roulette so far
+    bool count_emission = true;
 
-    // seed for random number generation
-    unsigned int global_seed = RANDOM_SEED_GLOBAL;
+    int depth;
+    for (depth = 0; depth < CONFIG.max_depth; ++depth)
+    {
+        size_t hit_index;
+        hit_record_geometry closest = hit_scene(r, &hit_index);
+
+        if (closest.t < REAL(0.0))
+        {
+            // no hit
+            STATS_INC(STAT_ESCAPES);
+            break;
+        }
+
+        material_union mat = *entity_material(hit_index);
+        STATS_INC(STAT_METAL_HITS + material_type_of(mat));
+        if (is_emissive_material(mat))
+        {
+            STATS_PATH(depth + 1);
+            if (count_emission)
+                radiance = vec3_add(radiance, vec3_scale(color_attenuation(emitted_hit(mat, closest), throughput), weight));
+            return radiance;
+        }
+
+        r = scatter_material(mat, closest, state);
+        throughput = color_transform_material(mat, throughput, state);
+
+        count_emission = !(CONFIG.nee && LIGHT_NUM > 0 && is_diffuse_material(mat));
+        if (!count_emission)
+        {
+            color direct = color_attenuation(direct_light(closest, state), throughput);
+            radiance = vec3_add(radiance, vec3_scale(direct, weight / MY_PI));
+        }
+
+        if (depth + 1 >= CONFIG.rr_depth)
+        {
+            real survive = vec3_max_component(throughput) * weight;
+            if (survive < REAL(1.0))
+            {
+                if (rand_unit(state) >= survive)
+                {
+                    STATS_PATH(depth + 1);
+                    return radiance;
+                }
+                weight /= survive;
+            }
+        }
+    }
+
+    STATS_PATH(depth < CONFIG.max_depth ? depth + 1 : CONFIG.max_depth);
+    return vec3_add(radiance, vec3_scale(color_attenuation(background_color(r), throughput), weight));
+}
+
+color ray_color(ray r, unsigned int *state)
+{
+    if (CONFIG.integrator == INTEGRATOR_FORWARD)
+        return ray_color_forward(r, state);
+
+    // fast paths for common depths
+    switch (CONFIG.max_depth)
+    {
+    case 5:
+        return ray_color_depth(r, state, 5);
+    case 8:
+        return ray_color_depth(r, state, 8);
+    case 16:
+        return ray_color_depth(r, state, 16);
+    default:
+        return ray_color_depth(r, state, CONFIG.max_depth);
+    }
+}
+
+// add samples [sample_begin, sample_end) of every pixel to the sums in image
+// stream is NULL unless rows are written as they finish
+void render(framebuffer *image, int sample_begin, int sample_end, ppm_stream *stream)
+{
+    struct timeval t1, t2;
 
     double total_time = 0.0;
 
-    for (int y = HEIGHT - 1; y >= 0; --y)
+    for (int y = CONFIG.height - 1; y >= 0; --y)
     {
 
         gettimeofday(&t1, NULL);
-        for (int x = 0; x < WIDTH; ++x)
+        for (int x = 0; x < CONFIG.width; ++x)
         {
 
-            color col = color_make(0.0, 0.0, 0.0);
+            color col = *framebuffer_at(image, x, CONFIG.height - 1 - y);
 
-            for (int s = 0; s < SAMPLING; ++s)
+            for (int s = sample_begin; s < sample_end && !adaptive_done(x, CONFIG.height - 1 - y); ++s)
             {
+                // every sample has its own random stream
+                unsigned int state = sample_seed(RANDOM_SEED_GLOBAL, CONFIG.frame, x, y, s);
+
                 // random number in [0, 1)
-                double x_offset = rand_unit(&global_seed);
-                double y_offset = rand_unit(&global_seed);
-                double u = ((double)x + x_offset) / (WIDTH - 1);
-                double v = ((double)y + y_offset) / (HEIGHT - 1);
+                real x_offset = rand_unit(&state);
+                real y_offset = rand_unit(&state);
+                real u = ((real)x + x_offset) / (CONFIG.width - 1);
+                real v = ((real)y + y_offset) / (CONFIG.height - 1);
 
                 vec3 direction = vec3_add(
                     LOWER_LEFT_CORNER,
@@ -79,12 +174,15 @@ void render(color image[HEIGHT][WIDTH])
                         vec3_scale(VERTICAL, v)));
 
                 ray r = ray_make(CAMERA_ORIGIN, direction);
-                col = vec3_add(col, ray_color(r, &global_seed));
+                color sample = ray_color(r, &state);
+                col = vec3_add(col, sample);
+                adaptive_add(x, CONFIG.height - 1 - y, sample);
             }
 
-            col = vec3_scale(col, 1.0 / SAMPLING);
-            image[HEIGHT - 1 - y][x] = col;
+            *framebuffer_at(image, x, CONFIG.height - 1 - y) = col;
         }
+        if (stream)
+            ppm_stream_write(stream, image, 0, CONFIG.height - 1 - y, CONFIG.width, CONFIG.height - y);
 
         gettimeofday(&t2, NULL);
         total_time = time_diff_sec(t1, t2);
@@ -92,38 +190,31 @@ void render(color image[HEIGHT][WIDTH])
     }
 }
 
-void save_ppm(const char *filename, color image[HEIGHT][WIDTH])
-{
-    FILE *f = fopen(filename, "wb");
-    if (!f)
-    {
-        perror("fopen");
-        exit(EXIT_FAILURE);
-    }
-
-    fprintf(f, "P3\n%d %d\n255\n", WIDTH, HEIGHT);
-    for (int y = 0; y < HEIGHT; ++y)
-        for (int x = 0; x < WIDTH; ++x)
-        {
-            write_color(f, image[y][x]);
-        }
-    fclose(f);
-}
-
 int main(int argc, char *argv[])
 {
+    parse_args(argc, argv, "ri_comb" PRECISION_SUFFIX ".ppm");
     setup_scene();
-    color image[HEIGHT][WIDTH];
+    framebuffer image = framebuffer_make(CONFIG.width, CONFIG.height);
+    ppm_stream stream;
+    if (CONFIG.stream)
+        ppm_stream_open(&stream, CONFIG.output, CONFIG.width, CONFIG.height, CONFIG.gamma);
 
     struct timeval t1, t2;
     gettimeofday(&t1, NULL);
 
-    render(image);
+    render_progressive(&image, CONFIG.stream ? &stream : NULL, render);
 
     gettimeofday(&t2, NULL);
     double total_time = time_diff_sec(t1, t2);
     printf("render done %f sec\n", total_time);
-
-    save_ppm("ri_comb.ppm", image);
+    stats_merge();
+    stats_report(total_time);
+    bvh_report(&BVH);
+
+    if (CONFIG.stream)
+        ppm_stream_close(&stream);
+    else
+        save_image(CONFIG.output, &image, CONFIG.ascii, CONFIG.gamma);
+    framebuffer_free(&image);
     return 0;
 }
@@ -1,43 +1,65 @@
 #include <stdio.h>
 #include <sys/time.h> // for time
+#include <omp.h>
 
 #include "vec3.h"
 #include "world_entity_comb.h"
 #include "scene_comb.h"
+#include "tile.h"
+#include "config.h"
+#include "image.h"
+#include "progressive.h"
 
-color ray_color(ray r, unsigned int *state)
+// hit materials of backward paths, CONFIG.max_depth per lane, one buffer per render thread;
+// on the heap because --depth goes up to CONFIG_MAX_DEPTH and worker stacks are small
+material_union *hit_mat_make(int lanes)
 {
-    material_union hit_mat[MAX_REFLECTION_DEPTH];
+    material_union *hit_mat = malloc(sizeof(material_union) * lanes * CONFIG.max_depth);
+    if (!hit_mat)
+    {
+        perror("hit_mat");
+        exit(1);
+    }
+    return hit_mat;
+}
 
+// max_depth is a constant in the fast paths of ray_color, so the loop gets specialized
+static inline color ray_color_depth(ray r, unsigned int *state, const int max_depth, material_union *hit_mat)
+{
     int reflection_depth = 0;
+    size_t light = BVH_NO_HIT;
+    hit_record_geometry light_rec = {0};
 
-    for (reflection_depth = 0; reflection_depth < MAX_REFLECTION_DEPTH; ++reflection_depth)
+    for (reflection_depth = 0; reflection_depth < max_depth; ++reflection_depth)
     {
-        hit_record_geometry closest = {.t = -1.0};
-        material_union mu;
+        size_t hit_index;
+        hit_record_geometry closest = hit_scene(r, &hit_index);
 
-        for (size_t i = 0; i < ENTITY_NUM; ++i)
+        if (closest.t < REAL(0.0))
         {
-            hit_record_geometry rec = hit_geometry(ENTITY[i].geo, r);
-            if (hit_record_closer(&closest, rec))
-            {
-                mu = ENTITY[i].mat;
-            }
+            // no hit
+            STATS_INC(STAT_ESCAPES);
+            break;
         }
-
-        if (closest.t < 0.0)
+        else if (is_emissive_material(*entity_material(hit_index)))
         {
-            // no hit
+            // the path ends on a light
+            STATS_INC(STAT_EMISSIVE_HITS);
+            light = hit_index;
+            light_rec = closest;
             break;
         }
         else
         {
+            material_union mu = *entity_material(hit_index);
+            STATS_INC(STAT_METAL_HITS + mu.type);
             r = scatter_material(mu, closest, state);
             hit_mat[reflection_depth] = mu;
         }
     }
 
-    color pixel_color = background_color(r);
+    STATS_PATH(reflection_depth < max_depth ? reflection_depth + 1 : max_depth);
+    color pixel_color = light != BVH_NO_HIT ? emitted_hit(*entity_material(light), light_rec) : background_color(r);
 
     // compute color by reverse order
     for (int i = reflection_depth - 1; i >= 0; --i)
@@ -48,87 +70,588 @@ color ray_color(ray r, unsigned int *state)
     return pixel_color;
 }
 
-void render(color image[HEIGHT][WIDTH])
+// forward integrator: the throughput is carried along the path instead of replaying hit_mat,
+// and after CONFIG.rr_depth bounces Russian roulette ends paths with little throughput left,
+// so CONFIG.max_depth (CONFIG_MAX_DEPTH unless --depth is given) only bounds the rare long path.
+// with CONFIG.nee, diffuse hits also take direct light through a shadow ray (direct_light);
+// a light reached by the bounce after such a hit is then not counted again.
+color ray_color_forward(ray r, unsigned int *state)
 {
-    struct timeval t1, t2;
+    color radiance = vec3_make(0.0, 0.0, 0.0);
+    color throughput = color_make(1.0, 1.0, 1.0);
+    real weight = 1.0; // 1 / survival probability of the roulette so far
+    bool count_emission = true;
+
+    int depth;
+    for (depth = 0; depth < CONFIG.max_depth; ++depth)
+    {
+        size_t hit_index;
+        hit_record_geometry closest = hit_scene(r, &hit_index);
+
+        if (closest.t < REAL(0.0))
+        {
+            // no hit
+            STATS_INC(STAT_ESCAPES);
+            break;
+        }
+
+        material_union mat = *entity_material(hit_index);
+        STATS_INC(STAT_METAL_HITS + material_type_of(mat));
+        if (is_emissive_material(mat))
+        {
+            STATS_PATH(depth + 1);
+            if (count_emission)
+                radiance = vec3_add(radiance, vec3_scale(color_attenuation(emitted_hit(mat, closest), throughput), weight));
+            return radiance;
+        }
+
+        r = scatter_material(mat, closest, state);
+        throughput = color_transform_material(mat, throughput, state);
+
+        count_emission = !(CONFIG.nee && LIGHT_NUM > 0 && is_diffuse_material(mat));
+        if (!count_emission)
+        {
+            color direct = color_attenuation(direct_light(closest, state), throughput);
+            radiance = vec3_add(radiance, vec3_scale(direct, weight / MY_PI));
+        }
+
+        if (depth + 1 >= CONFIG.rr_depth)
+        {
+            real survive = vec3_max_component(throughput) * weight;
+            if (survive < REAL(1.0))
+            {
+                if (rand_unit(state) >= survive)
+                {
+                    STATS_PATH(depth + 1);
+                    return radiance;
+                }
+                weight /= survive;
+            }
+        }
+    }
+
+    STATS_PATH(depth < CONFIG.max_depth ? depth + 1 : CONFIG.max_depth);
+    return vec3_add(radiance, vec3_scale(color_attenuation(background_color(r), throughput), weight));
+}
+
+// hit_mat is unused by the forward integrator and may be NULL then
+color ray_color(ray r, unsigned int *state, material_union *hit_mat)
+{
+    if (CONFIG.integrator == INTEGRATOR_FORWARD)
+        return ray_color_forward(r, state);
+
+    // fast paths for common depths
+    switch (CONFIG.max_depth)
+    {
+    case 5:
+        return ray_color_depth(r, state, 5, hit_mat);
+    case 8:
+        return ray_color_depth(r, state, 8, hit_mat);
+    case 16:
+        return ray_color_depth(r, state, 16, hit_mat);
+    default:
+        return ray_color_depth(r, state, CONFIG.max_depth, hit_mat);
+    }
+}
+
+// camera ray through pixel (x, y) jittered inside the pixel, y grows upward
+static inline ray camera_ray(int x, int y, unsigned int *state)
+{
+    // random number in [0, 1)
+    real x_offset = rand_unit(state);
+    real y_offset = rand_unit(state);
+    real u = ((real)x + x_offset) / (CONFIG.width - 1);
+    real v = ((real)y + y_offset) / (CONFIG.height - 1);
+
+    vec3 direction = vec3_add(
+        LOWER_LEFT_CORNER,
+        vec3_add(
+            vec3_scale(HORIZONTAL, u),
+            vec3_scale(VERTICAL, v)));
+
+    return ray_make(CAMERA_ORIGIN, direction);
+}
+
+// tile rows are image rows, row 0 is the top of the image
+void render_tile(framebuffer *image, tile t, int sample_begin, int sample_end, material_union *hit_mat)
+{
+    for (int row = t.y0; row < t.y1; ++row)
+    {
+        int y = CONFIG.height - 1 - row;
+        for (int x = t.x0; x < t.x1; ++x)
+        {
+            color col = *framebuffer_at(image, x, row);
+
+            for (int s = sample_begin; s < sample_end && !adaptive_done(x, row); ++s)
+            {
+                // every sample has its own random stream
+                unsigned int state = sample_seed(RANDOM_SEED_GLOBAL, CONFIG.frame, x, y, s);
+                ray r = camera_ray(x, y, &state);
+                color sample = ray_color(r, &state, hit_mat);
+                col = vec3_add(col, sample);
+                adaptive_add(x, row, sample);
+            }
+
+            *framebuffer_at(image, x, row) = col;
+        }
+    }
+}
+
+#if PACKET_TILE > 0
+#define PACKET_SIZE (PACKET_TILE * PACKET_TILE)
+
+// ray_color for a packet, lanes drop out of the packet when their ray escapes
+// only camera rays are traced together, bounces go lane by lane
+// hit_mat holds the lanes of one depth next to each other (hit_mat_make(PACKET_SIZE))
+void ray_color_packet(ray rays[PACKET_SIZE], const bool start_active[PACKET_SIZE],
+                      color pixel_color[PACKET_SIZE], unsigned int state[PACKET_SIZE], material_union *hit_mat)
+{
+    int reflection_depth[PACKET_SIZE];
+    size_t light[PACKET_SIZE];
+    hit_record_geometry light_rec[PACKET_SIZE];
+    bool active[PACKET_SIZE];
+
+    for (int k = 0; k < PACKET_SIZE; ++k)
+    {
+        reflection_depth[k] = 0;
+        light[k] = BVH_NO_HIT;
+        active[k] = start_active[k];
+    }
+
+    for (int depth = 0; depth < CONFIG.max_depth; ++depth)
+    {
+        hit_record_geometry closest[PACKET_SIZE];
+        size_t hit_index[PACKET_SIZE];
+        if (depth == 0)
+        {
+            hit_scene_packet(rays, active, PACKET_SIZE, closest, hit_index);
+        }
+        else
+        {
+            // scattered rays are incoherent, the packet would visit the union of their paths
+            for (int k = 0; k < PACKET_SIZE; ++k)
+            {
+                if (active[k])
+                    closest[k] = hit_scene(rays[k], &hit_index[k]);
+            }
+        }
+
+        bool any_active = false;
+        for (int k = 0; k < PACKET_SIZE; ++k)
+        {
+            if (!active[k])
+                continue;
+            if (closest[k].t < REAL(0.0))
+            {
+                // no hit
+                STATS_INC(STAT_ESCAPES);
+                active[k] = false;
+                continue;
+            }
+            material_union mu = *entity_material(hit_index[k]);
+            STATS_INC(STAT_METAL_HITS + mu.type);
+            if (is_emissive_material(mu))
+            {
+                // the path ends on a light
+                light[k] = hit_index[k];
+                light_rec[k] = closest[k];
+                active[k] = false;
+                continue;
+            }
+            rays[k] = scatter_material(mu, closest[k], &state[k]);
+            hit_mat[(size_t)depth * PACKET_SIZE + k] = mu;
+            reflection_depth[k] = depth + 1;
+            any_active = true;
+        }
+        if (!any_active)
+            break;
+    }
+
+    // compute color by reverse order
+    for (int k = 0; k < PACKET_SIZE; ++k)
+    {
+        if (!start_active[k])
+            continue;
+        STATS_PATH(reflection_depth[k] < CONFIG.max_depth ? reflection_depth[k] + 1 : CONFIG.max_depth);
+        pixel_color[k] = light[k] != BVH_NO_HIT ? emitted_hit(*entity_material(light[k]), light_rec[k]) : background_color(rays[k]);
+        for (int i = reflection_depth[k] - 1; i >= 0; --i)
+        {
+            pixel_color[k] = color_transform_material(hit_mat[(size_t)i * PACKET_SIZE + k], pixel_color[k], &state[k]);
+        }
+    }
+}
+
+// split a tile into PACKET_TILE x PACKET_TILE blocks, every sample of a block is traced as one packet
+void render_tile_packet(framebuffer *image, tile t, int sample_begin, int sample_end, material_union *hit_mat)
+{
+    for (int by = t.y0; by < t.y1; by += PACKET_TILE)
+    {
+        for (int bx = t.x0; bx < t.x1; bx += PACKET_TILE)
+        {
+            color col[PACKET_SIZE];
+            bool inside[PACKET_SIZE];
+            for (int k = 0; k < PACKET_SIZE; ++k)
+            {
+                inside[k] = bx + k % PACKET_TILE < t.x1 && by + k / PACKET_TILE < t.y1;
+                col[k] = inside[k] ? *framebuffer_at(image, bx + k % PACKET_TILE, by + k / PACKET_TILE) : vec3_make(0.0, 0.0, 0.0);
+            }
+
+            for (int s = sample_begin; s < sample_end; ++s)
+            {
+                // pixels that adaptive sampling has stopped leave the packet
+                bool live[PACKET_SIZE];
+                bool any_live = false;
+                for (int k = 0; k < PACKET_SIZE; ++k)
+                {
+                    live[k] = inside[k] && !adaptive_done(bx + k % PACKET_TILE, by + k / PACKET_TILE);
+                    any_live |= live[k];
+                }
+                if (!any_live)
+                    break;
+
+                ray rays[PACKET_SIZE];
+                unsigned int state[PACKET_SIZE];
+                for (int k = 0; k < PACKET_SIZE; ++k)
+                {
+                    int x = bx + k % PACKET_TILE;
+                    int y = CONFIG.height - 1 - (by + k / PACKET_TILE);
+                    // same stream as render_tile would use for this pixel and sample
+                    state[k] = sample_seed(RANDOM_SEED_GLOBAL, CONFIG.frame, x, y, s);
+                    rays[k] = camera_ray(x, y, &state[k]);
+                }
 
-    // seed for random number generation
-    unsigned int global_seed = RANDOM_SEED_GLOBAL;
+                color sample[PACKET_SIZE];
+                ray_color_packet(rays, live, sample, state, hit_mat);
+                for (int k = 0; k < PACKET_SIZE; ++k)
+                {
+                    if (live[k])
+                    {
+                        col[k] = vec3_add(col[k], sample[k]);
+                        adaptive_add(bx + k % PACKET_TILE, by + k / PACKET_TILE, sample[k]);
+                    }
+                }
+            }
+
+            for (int k = 0; k < PACKET_SIZE; ++k)
+            {
+                if (inside[k])
+                    *framebuffer_at(image, bx + k % PACKET_TILE, by + k / PACKET_TILE) = col[k];
+            }
+        }
+    }
+}
+#endif
 
-    double total_time = 0.0;
+#if WAVEFRONT_SIZE > 0
+// paths of one wave; the active list and the material queues hold path indices
+typedef struct
+{
+    ray rays[WAVEFRONT_SIZE];
+    unsigned int state[WAVEFRONT_SIZE];
+    int pixel[WAVEFRONT_SIZE]; // pixel index inside the tile
+    int depth[WAVEFRONT_SIZE]; // hits so far
+    bool lit[WAVEFRONT_SIZE];  // the path ended on the light hit_index
+    hit_record_geometry rec[WAVEFRONT_SIZE];
+    size_t hit_index[WAVEFRONT_SIZE];
+    uint32_t active[WAVEFRONT_SIZE];
+    uint32_t queue[MATERIAL_TYPE_NUM][WAVEFRONT_SIZE];
+    uint32_t *hits; // entity hit at every depth, CONFIG.max_depth per path
+} wavefront;
+
+// thread seconds spent in each stage
+typedef struct
+{
+    double generate, intersect, sort, scatter, shade;
+    size_t scattered[MATERIAL_TYPE_NUM]; // rays scattered by each material, paths ended on lights
+} wavefront_stats;
 
-#pragma omp parallel for
-    for (int y = HEIGHT - 1; y >= 0; --y)
+static wavefront_stats *WAVE_STATS;
+
+wavefront *wavefront_make(void)
+{
+    wavefront *w = malloc(sizeof(wavefront));
+    if (!w)
     {
+        perror("wavefront");
+        exit(1);
+    }
+    w->hits = malloc(sizeof(uint32_t) * WAVEFRONT_SIZE * CONFIG.max_depth);
+    if (!w->hits)
+    {
+        perror("wavefront");
+        free(w);
+        exit(1);
+    }
+    return w;
+}
+
+void wavefront_free(wavefront *w)
+{
+    free(w->hits);
+    free(w);
+}
 
-        unsigned int local_seed = global_seed;
+// the (pixel, sample) pairs of a tile go in pixel-major order, WAVEFRONT_SIZE per wave,
+// so every pixel adds its samples in the same order as render_tile
+void render_tile_wavefront(framebuffer *image, tile t, int sample_begin, int sample_end,
+                           wavefront *w, wavefront_stats *stats)
+{
+    const int max_depth = CONFIG.max_depth;
+    const int tile_width = t.x1 - t.x0;
+    const int samples = sample_end - sample_begin;
+    const size_t pair_num = (size_t)tile_width * (t.y1 - t.y0) * samples;
+    struct timeval t1, t2;
 
+    for (size_t first = 0; first < pair_num; first += WAVEFRONT_SIZE)
+    {
+        int n = pair_num - first < WAVEFRONT_SIZE ? (int)(pair_num - first) : WAVEFRONT_SIZE;
+
+        // generate camera rays
         gettimeofday(&t1, NULL);
-        for (int x = 0; x < WIDTH; ++x)
+        for (int p = 0; p < n; ++p)
         {
+            size_t pair = first + p;
+            int i = pair / samples;
+            int x = t.x0 + i % tile_width;
+            int y = CONFIG.height - 1 - (t.y0 + i / tile_width);
+            w->state[p] = sample_seed(RANDOM_SEED_GLOBAL, CONFIG.frame, x, y, sample_begin + pair % samples);
+            w->rays[p] = camera_ray(x, y, &w->state[p]);
+            w->pixel[p] = i;
+            w->depth[p] = 0;
+            w->lit[p] = false;
+            w->active[p] = p;
+        }
+        int active_num = n;
+        gettimeofday(&t2, NULL);
+        stats->generate += time_diff_sec(t1, t2);
 
-            color col = color_make(0.0, 0.0, 0.0);
+        for (int depth = 0; depth < max_depth && active_num > 0; ++depth)
+        {
+            // intersect every active path
+            gettimeofday(&t1, NULL);
+            for (int k = 0; k < active_num; ++k)
+            {
+                uint32_t p = w->active[k];
+                w->rec[p] = hit_scene(w->rays[p], &w->hit_index[p]);
+            }
+            gettimeofday(&t2, NULL);
+            stats->intersect += time_diff_sec(t1, t2);
 
-            for (int s = 0; s < SAMPLING; ++s)
+            // partition the hits by material, escaped paths leave the wave
+            t1 = t2;
+            int queue_num[MATERIAL_TYPE_NUM] = {0};
+            for (int k = 0; k < active_num; ++k)
             {
-                // random number in [0, 1)
-                double x_offset = rand_unit(&local_seed);
-                double y_offset = rand_unit(&local_seed);
-                double u = ((double)x + x_offset) / (WIDTH - 1);
-                double v = ((double)y + y_offset) / (HEIGHT - 1);
-
-                vec3 direction = vec3_add(
-                    LOWER_LEFT_CORNER,
-                    vec3_add(
-                        vec3_scale(HORIZONTAL, u),
-                        vec3_scale(VERTICAL, v)));
-
-                ray r = ray_make(CAMERA_ORIGIN, direction);
-                col = vec3_add(col, ray_color(r, &local_seed));
+                uint32_t p = w->active[k];
+                if (w->rec[p].t < REAL(0.0))
+                {
+                    STATS_INC(STAT_ESCAPES);
+                    continue;
+                }
+                material_type type = entity_material(w->hit_index[p])->type;
+                STATS_INC(STAT_METAL_HITS + type);
+                w->queue[type][queue_num[type]++] = p;
+                if (type == EMISSIVE)
+                {
+                    w->lit[p] = true;
+                    continue;
+                }
+                w->hits[(size_t)p * max_depth + depth] = w->hit_index[p];
+                w->depth[p] = depth + 1;
             }
+            gettimeofday(&t2, NULL);
+            stats->sort += time_diff_sec(t1, t2);
 
-            col = vec3_scale(col, 1.0 / SAMPLING);
-            image[HEIGHT - 1 - y][x] = col;
+            // scatter every material as one batch
+            t1 = t2;
+            active_num = 0;
+            for (int k = 0; k < queue_num[METAL]; ++k)
+            {
+                uint32_t p = w->queue[METAL][k];
+                w->rays[p] = scatter_metal(&entity_material(w->hit_index[p])->material.m, w->rec[p], &w->state[p]);
+                w->active[active_num++] = p;
+            }
+            for (int k = 0; k < queue_num[LAMBERTIAN]; ++k)
+            {
+                uint32_t p = w->queue[LAMBERTIAN][k];
+                w->rays[p] = scatter_lambertian(&entity_material(w->hit_index[p])->material.l, w->rec[p], &w->state[p]);
+                w->active[active_num++] = p;
+            }
+            for (int k = 0; k < queue_num[DIELECTRIC]; ++k)
+            {
+                uint32_t p = w->queue[DIELECTRIC][k];
+                w->rays[p] = scatter_dielectric(&entity_material(w->hit_index[p])->material.d, w->rec[p], &w->state[p]);
+                w->active[active_num++] = p;
+            }
+            for (int m = 0; m < MATERIAL_TYPE_NUM; ++m)
+            {
+                stats->scattered[m] += queue_num[m];
+            }
+            gettimeofday(&t2, NULL);
+            stats->scatter += time_diff_sec(t1, t2);
         }
 
+        // shade like ray_color: light or background at the end, then the hits in reverse order
+        gettimeofday(&t1, NULL);
+        for (int p = 0; p < n; ++p)
+        {
+            STATS_PATH(w->depth[p] < max_depth ? w->depth[p] + 1 : max_depth);
+            // a lit path left the wave, rec still holds its hit on the light
+            color col = w->lit[p] ? emitted_hit(*entity_material(w->hit_index[p]), w->rec[p]) : background_color(w->rays[p]);
+            for (int i = w->depth[p] - 1; i >= 0; --i)
+            {
+                col = color_transform_material(*entity_material(w->hits[(size_t)p * max_depth + i]), col, &w->state[p]);
+            }
+            color *sum = framebuffer_at(image, t.x0 + w->pixel[p] % tile_width, t.y0 + w->pixel[p] / tile_width);
+            *sum = vec3_add(*sum, col);
+        }
         gettimeofday(&t2, NULL);
-        total_time = time_diff_sec(t1, t2);
-        // printf("%i %f sec\n", y, total_time);
+        stats->shade += time_diff_sec(t1, t2);
     }
 }
 
-void save_ppm(const char *filename, color image[HEIGHT][WIDTH])
+void wavefront_report(const wavefront_stats *stats, int thread_num)
 {
-    FILE *f = fopen(filename, "wb");
-    if (!f)
+    wavefront_stats sum = {0};
+    for (int i = 0; i < thread_num; ++i)
     {
-        perror("fopen");
-        exit(EXIT_FAILURE);
+        sum.generate += stats[i].generate;
+        sum.intersect += stats[i].intersect;
+        sum.sort += stats[i].sort;
+        sum.scatter += stats[i].scatter;
+        sum.shade += stats[i].shade;
+        for (int m = 0; m < MATERIAL_TYPE_NUM; ++m)
+        {
+            sum.scattered[m] += stats[i].scattered[m];
+        }
     }
+    double total = sum.generate + sum.intersect + sum.sort + sum.scatter + sum.shade;
+    if (total <= 0.0)
+        total = 1.0;
+    printf("wavefront (thread sec): generate %f (%.1f%%), intersect %f (%.1f%%), sort %f (%.1f%%), "
+           "scatter %f (%.1f%%), shade %f (%.1f%%)\n",
+           sum.generate, 100.0 * sum.generate / total, sum.intersect, 100.0 * sum.intersect / total,
+           sum.sort, 100.0 * sum.sort / total, sum.scatter, 100.0 * sum.scatter / total,
+           sum.shade, 100.0 * sum.shade / total);
+    // the rays themselves are counted by the RT_STATS build (stats_report)
+    printf("wavefront scattered metal %zu, lambertian %zu, dielectric %zu, ended on lights %zu\n",
+           sum.scattered[METAL], sum.scattered[LAMBERTIAN], sum.scattered[DIELECTRIC],
+           sum.scattered[EMISSIVE]);
+}
+#endif
+
+static tile_thread_stats *THREAD_STATS;
+static int THREAD_NUM;
 
-    fprintf(f, "P3\n%d %d\n255\n", WIDTH, HEIGHT);
-    for (int y = 0; y < HEIGHT; ++y)
-        for (int x = 0; x < WIDTH; ++x)
+// threads take tiles from the scheduler until the image is done
+// add samples [sample_begin, sample_end) of every pixel to the sums in image
+// stream is NULL unless tiles are written as they finish
+void render(framebuffer *image, int sample_begin, int sample_end, ppm_stream *stream)
+{
+    tile_scheduler scheduler;
+    tile_scheduler_init(&scheduler, CONFIG.width, CONFIG.height, CONFIG.tile);
+
+    // stats add up over the passes
+    if (!THREAD_STATS)
+    {
+        THREAD_NUM = omp_get_max_threads();
+        THREAD_STATS = calloc(THREAD_NUM, sizeof(tile_thread_stats));
+#if WAVEFRONT_SIZE > 0
+        WAVE_STATS = calloc(THREAD_NUM, sizeof(wavefront_stats));
+#endif
+    }
+
+#pragma omp parallel
+    {
+        tile_thread_stats *stats = &THREAD_STATS[omp_get_thread_num()];
+        struct timeval t1, t2;
+        tile t;
+#if WAVEFRONT_SIZE > 0
+        wavefront *wave = CONFIG.integrator == INTEGRATOR_FORWARD ? NULL : wavefront_make();
+        material_union *hit_mat = NULL;
+#elif PACKET_TILE > 0
+        material_union *hit_mat = CONFIG.integrator == INTEGRATOR_FORWARD ? NULL : hit_mat_make(PACKET_SIZE);
+#else
+        material_union *hit_mat = CONFIG.integrator == INTEGRATOR_FORWARD ? NULL : hit_mat_make(1);
+#endif
+
+        while (tile_next(&scheduler, &t))
         {
-            write_color(f, image[y][x]);
+            gettimeofday(&t1, NULL);
+            // the packet and wavefront engines replay hit materials backward,
+            // forward paths are traced one by one
+            if (CONFIG.integrator == INTEGRATOR_FORWARD)
+                render_tile(image, t, sample_begin, sample_end, hit_mat);
+            else
+#if WAVEFRONT_SIZE > 0
+                render_tile_wavefront(image, t, sample_begin, sample_end, wave, &WAVE_STATS[omp_get_thread_num()]);
+#elif PACKET_TILE > 0
+                render_tile_packet(image, t, sample_begin, sample_end, hit_mat);
+#else
+                render_tile(image, t, sample_begin, sample_end, hit_mat);
+#endif
+            if (stream)
+                ppm_stream_write(stream, image, t.x0, t.y0, t.x1, t.y1);
+            gettimeofday(&t2, NULL);
+
+            stats->busy_sec += time_diff_sec(t1, t2);
+            stats->tiles++;
+            stats->pixels += (size_t)(t.x1 - t.x0) * (t.y1 - t.y0);
         }
-    fclose(f);
+#if WAVEFRONT_SIZE > 0
+        if (wave)
+            wavefront_free(wave);
+#endif
+        free(hit_mat);
+        stats_merge();
+    }
+
+    tile_scheduler_free(&scheduler);
 }
 
 int main(int argc, char *argv[])
 {
+    parse_args(argc, argv, "ri_comb_omp" PRECISION_SUFFIX ".ppm");
+#if WAVEFRONT_SIZE > 0
+    if (CONFIG.noise > 0.0)
+    {
+        fprintf(stderr, "the wavefront engine does not support adaptive sampling\n");
+        exit(1);
+    }
+#endif
+#if WAVEFRONT_SIZE > 0 || PACKET_TILE > 0
+    if (CONFIG.integrator == INTEGRATOR_FORWARD)
+        fprintf(stderr, "the %s engine traces backward only, forward paths are traced one by one\n",
+                WAVEFRONT_SIZE > 0 ? "wavefront" : "packet");
+#endif
     setup_scene();
-    color image[HEIGHT][WIDTH];
+    framebuffer image = framebuffer_make(CONFIG.width, CONFIG.height);
+    ppm_stream stream;
+    if (CONFIG.stream)
+        ppm_stream_open(&stream, CONFIG.output, CONFIG.width, CONFIG.height, CONFIG.gamma);
 
     struct timeval t1, t2;
     gettimeofday(&t1, NULL);
 
-    render(image);
+    render_progressive(&image, CONFIG.stream ? &stream : NULL, render);
 
     gettimeofday(&t2, NULL);
     double total_time = time_diff_sec(t1, t2);
     printf("render done %f sec\n", total_time);
+    stats_merge();
+    stats_report(total_time);
+    bvh_report(&BVH);
+    if (!CONFIG.quiet)
+        tile_report(THREAD_STATS, THREAD_NUM);
+#if WAVEFRONT_SIZE > 0
+    if (CONFIG.integrator != INTEGRATOR_FORWARD)
+        wavefront_report(WAVE_STATS, THREAD_NUM);
+#endif
 
-    save_ppm("ri_comb_omp.ppm", image);
+    if (CONFIG.stream)
+        ppm_stream_close(&stream);
+    else
+        save_image(CONFIG.output, &image, CONFIG.ascii, CONFIG.gamma);
+    framebuffer_free(&image);
     return 0;
 }
@@ -7,7 +7,9 @@
 #include "vec3.h"
 #include "world_entity.h"
 #include "parse.h"
+#include "bvh.h"
 #include "settings.h"
+#include "config.h"
 
 static vec3 CAMERA_ORIGIN;
 static vec3 HORIZONTAL;
@@ -16,11 +18,160 @@ static vec3 LOWER_LEFT_CORNER;
 
 static entity *ENTITY;
 static size_t ENTITY_NUM;
+static bvh BVH;
+
+static inline material *entity_material(size_t entity_index)
+{
+    return &ENTITY[entity_index].mat;
+}
+
+static size_t hit_entity_leaf(const void *ctx, const bvh_node *leaf, size_t node_index,
+                              ray r, hit_record_geometry *closest)
+{
+    const entity *ents = ctx;
+    size_t hit_index = BVH_NO_HIT;
+    for (size_t i = leaf->left_first; i < leaf->left_first + leaf->count; ++i)
+    {
+        if (hit_record_closer(closest, hit_geometry(ents[i].geo, r)))
+            hit_index = i;
+    }
+    return hit_index;
+}
+
+// closest hit over all entities, hit_index receives the index into ENTITY
+static inline hit_record_geometry hit_scene(ray r, size_t *hit_index)
+{
+    hit_record_geometry closest = {.t = -1.0};
+    *hit_index = bvh_closest_hit(&BVH, r, &closest, hit_entity_leaf, ENTITY);
+    return closest;
+}
+
+static bool occluded_entity_leaf(const void *ctx, const bvh_node *leaf, size_t node_index,
+                                 ray r, real t_max)
+{
+    const entity *ents = ctx;
+    for (size_t i = leaf->left_first; i < leaf->left_first + leaf->count; ++i)
+    {
+        if (occluded_geometry(ents[i].geo, r, t_max))
+            return true;
+    }
+    return false;
+}
+
+// any hit closer than t_max, for shadow and visibility rays
+static inline bool occluded_scene(ray r, real t_max)
+{
+    STATS_INC(STAT_SHADOW_RAYS);
+    return bvh_any_hit(&BVH, r, t_max, occluded_entity_leaf, ENTITY);
+}
+
+// emissive entities, indices into ENTITY
+static size_t *LIGHT;
+static size_t LIGHT_NUM;
+
+// a shadow ray is blocked by hits closer than this fraction of the distance to the light
+#define SHADOW_RAY_MARGIN REAL(1e-3)
+
+// collect the lights, after the bvh has reordered ENTITY
+static void build_scene_lights()
+{
+    LIGHT = malloc(sizeof(size_t) * (ENTITY_NUM > 0 ? ENTITY_NUM : 1));
+    LIGHT_NUM = 0;
+    for (size_t i = 0; i < ENTITY_NUM; ++i)
+    {
+        if (is_emissive_material(*entity_material(i)))
+        {
+            // the first area query prepares a mesh light for sampling, see area_mesh
+            area_geometry(ENTITY[i].geo);
+            LIGHT[LIGHT_NUM++] = i;
+        }
+    }
+}
+
+// next-event estimation at a diffuse hit: a shadow ray to a uniform point on a random light.
+// returns emitted * cos_surface * cos_light / (distance^2 * pdf), the caller applies albedo / pi
+static color direct_light(hit_record_geometry rec, unsigned int *state)
+{
+    color none = vec3_make(0.0, 0.0, 0.0);
+    if (LIGHT_NUM == 0)
+        return none;
+
+    size_t pick = (size_t)(rand_unit(state) * LIGHT_NUM);
+    size_t light = LIGHT[pick < LIGHT_NUM ? pick : LIGHT_NUM - 1];
+    vec3 light_normal;
+    point y = sample_geometry(ENTITY[light].geo, state, &light_normal);
+    point x = point_of_hit(rec);
+
+    // the normal on the side the ray came from
+    vec3 normal = vec3_dot(rec.r.direction, rec.normal) > REAL(0.0) ? vec3_inv(rec.normal) : rec.normal;
+    vec3 to_light = vec3_sub(y, x);
+    real dist2 = vec3_dot(to_light, to_light);
+    if (!(dist2 > REAL(0.0)))
+        return none;
+    real dist = sqrt(dist2);
+    vec3 wi = vec3_scale(to_light, REAL(1.0) / dist);
+    real cos_surface = vec3_dot(normal, wi);
+    real cos_light = -vec3_dot(light_normal, wi);
+    if (cos_surface <= REAL(0.0) || cos_light <= REAL(0.0))
+        return none;
+
+    // the light itself cannot block: the sampled point faces x and the light is convex or flat
+    if (occluded_scene(ray_make(x, wi), dist * (REAL(1.0) - SHADOW_RAY_MARGIN)))
+        return none;
+
+    real pdf = REAL(1.0) / (LIGHT_NUM * area_geometry(ENTITY[light].geo));
+    return vec3_scale(emitted_material(*entity_material(light)), cos_surface * cos_light / (dist2 * pdf));
+}
+
+// build the hierarchy and reorder ENTITY so that every leaf is a contiguous range
+static void build_scene_bvh()
+{
+    aabb *bounds = malloc(sizeof(aabb) * (ENTITY_NUM > 0 ? ENTITY_NUM : 1));
+    for (size_t i = 0; i < ENTITY_NUM; ++i)
+    {
+        bounds[i] = bounds_geometry(ENTITY[i].geo);
+    }
+    bvh_build(&BVH, bounds, ENTITY_NUM);
+    free(bounds);
+
+    entity *sorted = malloc(sizeof(entity) * (ENTITY_NUM > 0 ? ENTITY_NUM : 1));
+    for (size_t i = 0; i < ENTITY_NUM; ++i)
+    {
+        sorted[i] = ENTITY[BVH.index[i]];
+    }
+    free(ENTITY);
+    ENTITY = sorted;
+}
+
+// the geometry of a define, made once and shared by all of its instances
+static geometry definition_geometry(parse_definition *def)
+{
+    if (!def->built)
+    {
+        geometry *g = ARENA_NEW(&DEFINITION_ARENA, geometry);
+        switch (def->geo_type)
+        {
+        case SPHERE:
+            *g = create_sphere(def->sph);
+            break;
+        case TRIANGLE:
+            *g = create_triangle(def->tri);
+            break;
+        case MESH:
+            *g = create_mesh(def->msh);
+            break;
+        default:
+            break;
+        }
+        def->built = g;
+    }
+    return *(geometry *)def->built;
+}
 
 void setup_scene()
 {
     CAMERA_ORIGIN = vec3_make(0.0, 0.0, 0.0);
-    HORIZONTAL = vec3_make(VIEWPORT_WIDTH, 0.0, 0.0);
+    HORIZONTAL = vec3_make(VIEWPORT_HEIGHT * CONFIG.width / CONFIG.height, 0.0, 0.0);
     VERTICAL = vec3_make(0.0, VIEWPORT_HEIGHT, 0.0);
 
     // (horizontal + vertical)/2 + (0, 0, focal_length)
@@ -33,7 +184,16 @@ void setup_scene()
         CAMERA_ORIGIN,
         lower_left_corner_vector);
 
-    size_t entity_count = setup_file();
+    // the cache stores union entities, this renderer's geometry holds function pointers
+    if (CONFIG.scene_cache[0] != '\0')
+    {
+        fprintf(stderr, "--scene_cache is only supported by the ray_tracing_comb renderers\n");
+        exit(1);
+    }
+
+    parse_quiet = CONFIG.quiet;
+    mesh_quiet = CONFIG.quiet;
+    size_t entity_count = setup_file(CONFIG.scene);
     ENTITY = malloc(sizeof(entity) * entity_count);
 
     result res;
@@ -49,6 +209,12 @@ void setup_scene()
         case TRIANGLE:
             geo = create_triangle(res.tri);
             break;
+        case MESH:
+            geo = create_mesh(res.msh);
+            break;
+        case INSTANCE:
+            geo = create_instance(definition_geometry(res.inst_def), res.inst_xf);
+            break;
         }
         switch (res.mat_type)
         {
@@ -61,10 +227,28 @@ void setup_scene()
         case DIELECTRIC:
             mat = dielectric_material(res.die);
             break;
+        case EMISSIVE:
+            mat = emissive_material(res.emi);
+            break;
         }
         ENTITY[ENTITY_NUM++] = (entity) { .geo = geo, .mat = mat };
     
     }
+
+    build_scene_bvh();
+    build_scene_lights();
+}
+
+// everything setup_scene made, at shutdown
+void free_scene()
+{
+    free(ENTITY);
+    free(LIGHT);
+    ENTITY = NULL;
+    LIGHT = NULL;
+    ENTITY_NUM = LIGHT_NUM = 0;
+    bvh_free(&BVH);
+    free_world_entities();
 }
 
 #endif
\ No newline at end of file
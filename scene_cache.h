@@ -0,0 +1,424 @@
+#ifndef SCENE_CACHE_H
+#define SCENE_CACHE_H
+
+// 組み立て済みのシーン (BVH の順に並べた entity、材質の表、BVH、メッシュ、インスタンス) をそのままファイルに書き出し、
+// 次からはそのファイルを mmap して使う。テキストの解析も BVH の構築もしない。
+// ファイルの中ではポインタを番号で持ち、読み込むときに張り直す。
+// 元のシーンファイルやメッシュファイルの大きさか更新時刻が変わっていれば作り直す。
+// world_entity_comb.h の entity を使うレンダラーだけが使う。
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h> // for time
+#include "world_entity_comb.h"
+#include "bvh.h"
+#include "mesh.h"
+#include "utils.h"
+
+#define SCENE_CACHE_MAGIC "RTSCN03" // 03: inner bvh nodes are marked by BVH_INNER_NODE
+#define SCENE_CACHE_ALIGN 64
+
+typedef struct
+{
+    int64_t size;
+    int64_t mtime;
+} file_stamp;
+
+typedef struct
+{
+    char magic[8];
+    uint32_t real_size, entity_size, material_size, node_size, instance_size; // the layout of this build
+    char source[MESH_NAME_LEN];
+    file_stamp source_stamp;
+    bvh_stats stats;
+    uint64_t entity_num, material_num, node_num, mesh_num, base_num, instance_num;
+    uint64_t entity_offset, material_offset, node_offset, mesh_offset, base_offset, instance_offset;
+} scene_cache_header;
+
+typedef struct
+{
+    char name[MESH_NAME_LEN];
+    file_stamp stamp;
+    uint64_t vertex_num, normal_num, triangle_num, node_num;
+    uint64_t vertex_offset, normal_offset, index_offset, normal_index_offset, node_offset; // 0 when absent
+} scene_cache_mesh;
+
+static bool file_stamp_get(const char *filename, file_stamp *stamp)
+{
+    struct stat st;
+    if (stat(filename, &st) != 0)
+        return false;
+    stamp->size = st.st_size;
+    stamp->mtime = st.st_mtime;
+    return true;
+}
+
+static bool file_stamp_current(const char *filename, file_stamp stamp)
+{
+    file_stamp now;
+    return file_stamp_get(filename, &now) && now.size == stamp.size && now.mtime == stamp.mtime;
+}
+
+// ====== save ======
+
+// pad to SCENE_CACHE_ALIGN and write, return the offset of the data
+static uint64_t scene_cache_write(FILE *f, const void *data, size_t bytes)
+{
+    static const char zeros[SCENE_CACHE_ALIGN];
+    long pos = ftell(f);
+    long pad = (SCENE_CACHE_ALIGN - pos % SCENE_CACHE_ALIGN) % SCENE_CACHE_ALIGN;
+    if (fwrite(zeros, 1, pad, f) != (size_t)pad || (bytes > 0 && fwrite(data, 1, bytes, f) != bytes))
+    {
+        perror("scene_cache_write");
+        exit(1);
+    }
+    return pos + pad;
+}
+
+static size_t scene_cache_mesh_index(const mesh *m)
+{
+    for (size_t i = 0; i < MESH_TABLE_NUM; ++i)
+    {
+        if (MESH_TABLE[i] == m)
+            return i;
+    }
+    fprintf(stderr, "scene cache: mesh not in the table\n");
+    exit(1);
+}
+
+// the mesh pointer of g becomes its index in MESH_TABLE
+static void scene_cache_pack_mesh(geometry_union *g)
+{
+    if (g->type == MESH)
+        g->geometry.m.m = (mesh *)(uintptr_t)scene_cache_mesh_index(g->geometry.m.m);
+}
+
+// write the built scene (ents in bvh order, their materials) to filename, through a temporary file
+void scene_cache_save(const char *filename, const char *source, const entity *ents, size_t entity_num,
+                      const material_union *materials, size_t material_num, const bvh *b)
+{
+    char tmp[2 * MESH_NAME_LEN];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", filename);
+    FILE *f = fopen(tmp, "wb");
+    if (!f)
+    {
+        perror(tmp);
+        exit(1);
+    }
+
+    scene_cache_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, SCENE_CACHE_MAGIC, sizeof(h.magic));
+    h.real_size = sizeof(real);
+    h.entity_size = sizeof(entity);
+    h.material_size = sizeof(material_union);
+    h.node_size = sizeof(bvh_node);
+    h.instance_size = sizeof(instance);
+    snprintf(h.source, sizeof(h.source), "%s", source);
+    file_stamp_get(source, &h.source_stamp);
+    h.stats = b->stats;
+    scene_cache_write(f, &h, sizeof(h));
+
+    // instances and their shared bases get indices, pointers become those indices
+    entity *packed = malloc(sizeof(entity) * (entity_num > 0 ? entity_num : 1));
+    memcpy(packed, ents, sizeof(entity) * entity_num);
+    const geometry_union **base_of = malloc(sizeof(geometry_union *) * (entity_num > 0 ? entity_num : 1));
+    instance *instances = malloc(sizeof(instance) * (entity_num > 0 ? entity_num : 1));
+    for (size_t i = 0; i < entity_num; ++i)
+    {
+        geometry_union *g = &packed[i].geo;
+        if (g->type == INSTANCE)
+        {
+            const instance *inst = g->geometry.i;
+            size_t base = 0;
+            while (base < h.base_num && base_of[base] != inst->base)
+                base++;
+            if (base == h.base_num)
+                base_of[h.base_num++] = inst->base;
+
+            instances[h.instance_num] = *inst;
+            instances[h.instance_num].base = (const geometry_union *)(uintptr_t)base;
+            g->geometry.i = (instance *)(uintptr_t)h.instance_num++;
+        }
+        scene_cache_pack_mesh(g);
+    }
+
+    h.entity_num = entity_num;
+    h.entity_offset = scene_cache_write(f, packed, sizeof(entity) * entity_num);
+    h.material_num = material_num;
+    h.material_offset = scene_cache_write(f, materials, sizeof(material_union) * material_num);
+    h.node_num = b->node_num;
+    h.node_offset = scene_cache_write(f, b->nodes, sizeof(bvh_node) * b->node_num);
+
+    scene_cache_mesh *meshes = calloc(MESH_TABLE_NUM + 1, sizeof(scene_cache_mesh));
+    for (size_t i = 0; i < MESH_TABLE_NUM; ++i)
+    {
+        const mesh *m = MESH_TABLE[i];
+        scene_cache_mesh *rec = &meshes[i];
+        strcpy(rec->name, m->name);
+        file_stamp_get(m->name, &rec->stamp);
+        rec->vertex_num = m->vertex_num;
+        rec->normal_num = m->normal_num;
+        rec->triangle_num = m->triangle_num;
+        rec->node_num = m->tree.node_num;
+        rec->vertex_offset = scene_cache_write(f, m->vertices, sizeof(point) * m->vertex_num);
+        if (m->normals)
+            rec->normal_offset = scene_cache_write(f, m->normals, sizeof(vec3) * m->normal_num);
+        rec->index_offset = scene_cache_write(f, m->indices, sizeof(uint32_t) * 3 * m->triangle_num);
+        if (m->normal_indices)
+            rec->normal_index_offset = scene_cache_write(f, m->normal_indices, sizeof(uint32_t) * 3 * m->triangle_num);
+        rec->node_offset = scene_cache_write(f, m->tree.nodes, sizeof(bvh_node) * m->tree.node_num);
+    }
+    h.mesh_num = MESH_TABLE_NUM;
+    h.mesh_offset = scene_cache_write(f, meshes, sizeof(scene_cache_mesh) * MESH_TABLE_NUM);
+
+    geometry_union *bases = malloc(sizeof(geometry_union) * (h.base_num > 0 ? h.base_num : 1));
+    for (size_t i = 0; i < h.base_num; ++i)
+    {
+        bases[i] = *base_of[i];
+        scene_cache_pack_mesh(&bases[i]);
+    }
+    h.base_offset = scene_cache_write(f, bases, sizeof(geometry_union) * h.base_num);
+    h.instance_offset = scene_cache_write(f, instances, sizeof(instance) * h.instance_num);
+
+    fseek(f, 0, SEEK_SET);
+    if (fwrite(&h, sizeof(h), 1, f) != 1 || fclose(f) != 0 || rename(tmp, filename) != 0)
+    {
+        perror(filename);
+        exit(1);
+    }
+    free(packed);
+    free(base_of);
+    free(instances);
+    free(meshes);
+    free(bases);
+    printf("scene cache written: %s\n", filename);
+}
+
+// ====== load ======
+
+// num elements of elem_size at offset lie inside the file, offset as scene_cache_write aligns it
+static bool scene_cache_fits(uint64_t offset, uint64_t num, uint64_t elem_size, uint64_t file_size)
+{
+    return offset % SCENE_CACHE_ALIGN == 0 && offset <= file_size && num <= (file_size - offset) / elem_size;
+}
+
+// children come after their parent and inside the array, leaves inside the primitives,
+// and no path is deeper than the traversal stack
+static bool scene_cache_nodes_valid(const bvh_node *nodes, uint64_t node_num, uint64_t prim_num)
+{
+    if (node_num == 0)
+        return false;
+    uint8_t *depth = calloc(node_num, 1);
+    bool ok = true;
+    for (uint64_t i = 0; ok && i < node_num; ++i)
+    {
+        const bvh_node *node = &nodes[i];
+        if (bvh_is_leaf(node))
+        {
+            ok = (uint64_t)node->left_first + node->count <= prim_num;
+        }
+        else
+        {
+            ok = node->left_first > i && (uint64_t)node->left_first + 1 < node_num && depth[i] + 2 < BVH_STACK_SIZE;
+            if (ok)
+                depth[node->left_first] = depth[node->left_first + 1] = depth[i] + 1;
+        }
+    }
+    free(depth);
+    return ok;
+}
+
+static bool scene_cache_mesh_valid(const char *map, uint64_t size, const scene_cache_mesh *rec)
+{
+    const uint64_t tri_bytes = 3 * sizeof(uint32_t);
+    if (!memchr(rec->name, '\0', sizeof(rec->name)) ||
+        !scene_cache_fits(rec->vertex_offset, rec->vertex_num, sizeof(point), size) ||
+        (rec->normal_offset && !scene_cache_fits(rec->normal_offset, rec->normal_num, sizeof(vec3), size)) ||
+        !scene_cache_fits(rec->index_offset, rec->triangle_num, tri_bytes, size) ||
+        (rec->normal_index_offset && !scene_cache_fits(rec->normal_index_offset, rec->triangle_num, tri_bytes, size)) ||
+        !scene_cache_fits(rec->node_offset, rec->node_num, sizeof(bvh_node), size))
+        return false;
+
+    const uint32_t *indices = (const uint32_t *)(map + rec->index_offset);
+    for (uint64_t i = 0; i < 3 * rec->triangle_num; ++i)
+    {
+        if (indices[i] >= rec->vertex_num)
+            return false;
+    }
+    if (rec->normal_index_offset)
+    {
+        uint64_t normal_num = rec->normal_offset ? rec->normal_num : 0;
+        const uint32_t *normal_indices = (const uint32_t *)(map + rec->normal_index_offset);
+        for (uint64_t i = 0; i < 3 * rec->triangle_num; ++i)
+        {
+            if (normal_indices[i] != MESH_NO_NORMAL && normal_indices[i] >= normal_num)
+                return false;
+        }
+    }
+    return scene_cache_nodes_valid((const bvh_node *)(map + rec->node_offset), rec->node_num, rec->triangle_num);
+}
+
+// every index that load turns into a pointer names something in the file
+static bool scene_cache_refs_valid(const char *map, const scene_cache_header *h)
+{
+    const material_union *materials = (const material_union *)(map + h->material_offset);
+    for (uint64_t i = 0; i < h->material_num; ++i)
+    {
+        if ((unsigned)materials[i].type >= MATERIAL_TYPE_NUM)
+            return false;
+    }
+
+    // bases are what defines name, never an instance
+    const geometry_union *bases = (const geometry_union *)(map + h->base_offset);
+    for (uint64_t i = 0; i < h->base_num; ++i)
+    {
+        geometry_type type = bases[i].type;
+        if ((unsigned)type >= INSTANCE || (type == MESH && (uintptr_t)bases[i].geometry.m.m >= h->mesh_num))
+            return false;
+    }
+
+    const instance *instances = (const instance *)(map + h->instance_offset);
+    for (uint64_t i = 0; i < h->instance_num; ++i)
+    {
+        if ((uintptr_t)instances[i].base >= h->base_num)
+            return false;
+    }
+
+    const entity *e = (const entity *)(map + h->entity_offset);
+    for (uint64_t i = 0; i < h->entity_num; ++i)
+    {
+        const geometry_union *g = &e[i].geo;
+        if ((unsigned)g->type >= GEOMETRY_TYPE_NUM || e[i].material >= h->material_num ||
+            (g->type == MESH && (uintptr_t)g->geometry.m.m >= h->mesh_num) ||
+            (g->type == INSTANCE && (uintptr_t)g->geometry.i >= h->instance_num))
+            return false;
+    }
+    return true;
+}
+
+// map filename and point ents, materials and b into it.
+// false when the file is missing, was written by another build, is older than its sources or is damaged
+bool scene_cache_load(const char *filename, const char *source, entity **ents, size_t *entity_num,
+                      material_union **materials, size_t *material_num, bvh *b)
+{
+    struct timeval t1, t2;
+    gettimeofday(&t1, NULL);
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(scene_cache_header))
+    {
+        close(fd);
+        return false;
+    }
+    // private pages: the pointers are patched in memory, the file is never written
+    char *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return false;
+
+    const scene_cache_header *h = (const scene_cache_header *)map;
+    uint64_t size = st.st_size;
+    bool ok = memcmp(h->magic, SCENE_CACHE_MAGIC, sizeof(h->magic)) == 0 &&
+              h->real_size == sizeof(real) && h->entity_size == sizeof(entity) &&
+              h->material_size == sizeof(material_union) &&
+              h->node_size == sizeof(bvh_node) && h->instance_size == sizeof(instance) &&
+              strncmp(h->source, source, sizeof(h->source)) == 0 &&
+              file_stamp_current(source, h->source_stamp) &&
+              scene_cache_fits(h->entity_offset, h->entity_num, sizeof(entity), size) &&
+              scene_cache_fits(h->material_offset, h->material_num, sizeof(material_union), size) &&
+              scene_cache_fits(h->node_offset, h->node_num, sizeof(bvh_node), size) &&
+              scene_cache_fits(h->mesh_offset, h->mesh_num, sizeof(scene_cache_mesh), size) &&
+              scene_cache_fits(h->base_offset, h->base_num, sizeof(geometry_union), size) &&
+              scene_cache_fits(h->instance_offset, h->instance_num, sizeof(instance), size);
+
+    // a truncated or damaged file must not send any pointer outside the mapping
+    const scene_cache_mesh *mesh_recs = (const scene_cache_mesh *)(map + h->mesh_offset);
+    for (size_t i = 0; ok && i < h->mesh_num; ++i)
+    {
+        ok = scene_cache_mesh_valid(map, size, &mesh_recs[i]) &&
+             file_stamp_current(mesh_recs[i].name, mesh_recs[i].stamp);
+    }
+    ok = ok && scene_cache_nodes_valid((const bvh_node *)(map + h->node_offset), h->node_num, h->entity_num) &&
+         scene_cache_refs_valid(map, h);
+    if (!ok)
+    {
+        printf("scene cache %s does not match %s or is damaged, rebuilding it\n", filename, source);
+        munmap(map, st.st_size);
+        return false;
+    }
+
+    // the meshes join MESH_TABLE, their arrays stay in the mapping
+    size_t first_mesh = MESH_TABLE_NUM;
+    MESH_TABLE = realloc(MESH_TABLE, sizeof(mesh *) * (MESH_TABLE_NUM + h->mesh_num));
+    mesh **meshes = MESH_TABLE + first_mesh;
+    for (size_t i = 0; i < h->mesh_num; ++i)
+    {
+        const scene_cache_mesh *rec = &mesh_recs[i];
+        mesh *m = calloc(1, sizeof(mesh));
+        strcpy(m->name, rec->name);
+        m->vertex_num = rec->vertex_num;
+        m->normal_num = rec->normal_num;
+        m->triangle_num = rec->triangle_num;
+        m->vertices = (point *)(map + rec->vertex_offset);
+        m->normals = rec->normal_offset ? (vec3 *)(map + rec->normal_offset) : NULL;
+        m->indices = (uint32_t *)(map + rec->index_offset);
+        m->normal_indices = rec->normal_index_offset ? (uint32_t *)(map + rec->normal_index_offset) : NULL;
+        m->tree.nodes = (bvh_node *)(map + rec->node_offset);
+        m->tree.node_num = rec->node_num;
+        m->tree.prim_num = rec->triangle_num;
+        meshes[i] = m;
+    }
+    MESH_TABLE_NUM += h->mesh_num;
+
+    geometry_union *bases = (geometry_union *)(map + h->base_offset);
+    for (size_t i = 0; i < h->base_num; ++i)
+    {
+        if (bases[i].type == MESH)
+            bases[i].geometry.m.m = meshes[(uintptr_t)bases[i].geometry.m.m];
+    }
+
+    instance *instances = (instance *)(map + h->instance_offset);
+    for (size_t i = 0; i < h->instance_num; ++i)
+    {
+        instances[i].base = &bases[(uintptr_t)instances[i].base];
+    }
+
+    entity *e = (entity *)(map + h->entity_offset);
+    for (size_t i = 0; i < h->entity_num; ++i)
+    {
+        geometry_union *g = &e[i].geo;
+        if (g->type == MESH)
+            g->geometry.m.m = meshes[(uintptr_t)g->geometry.m.m];
+        else if (g->type == INSTANCE)
+            g->geometry.i = &instances[(uintptr_t)g->geometry.i];
+    }
+
+    b->nodes = (bvh_node *)(map + h->node_offset);
+    b->node_num = h->node_num;
+    b->index = NULL;
+    b->prim_num = h->entity_num;
+    b->stats = h->stats;
+    *ents = e;
+    *entity_num = h->entity_num;
+    *materials = (material_union *)(map + h->material_offset);
+    *material_num = h->material_num;
+
+    gettimeofday(&t2, NULL);
+    printf("scene cache %s: %zu entities, %zu meshes, %zu instances, load %f sec\n",
+           filename, (size_t)h->entity_num, (size_t)h->mesh_num, (size_t)h->instance_num,
+           time_diff_sec(t1, t2));
+    return true;
+}
+
+#endif
@@ -2,12 +2,20 @@
 #define SCENE
 
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 #include <math.h>
 #include "vec3.h"
 #include "world_entity_comb.h"
 #include "parse.h"
+#include "bvh.h"
+#include "packet.h"
+#ifdef USE_SIMD
+#include "world_entity_soa.h"
+#endif
 #include "settings.h"
+#include "config.h"
+#include "scene_cache.h"
 
 static vec3 CAMERA_ORIGIN;
 static vec3 HORIZONTAL;
@@ -16,11 +24,203 @@ static vec3 LOWER_LEFT_CORNER;
 
 static entity *ENTITY;
 static size_t ENTITY_NUM;
+static material_union *MATERIAL;
+static size_t MATERIAL_NUM;
+static bvh BVH;
+#ifdef USE_SIMD
+static soa_store SOA;
+#endif
+
+static inline material_union *entity_material(size_t entity_index)
+{
+    return &MATERIAL[ENTITY[entity_index].material];
+}
+
+#ifndef USE_SIMD
+static size_t hit_entity_leaf(const void *ctx, const bvh_node *leaf, size_t node_index,
+                              ray r, hit_record_geometry *closest)
+{
+    const entity *ents = ctx;
+    size_t hit_index = BVH_NO_HIT;
+    for (size_t i = leaf->left_first; i < leaf->left_first + leaf->count; ++i)
+    {
+        if (hit_record_closer(closest, hit_geometry(ents[i].geo, r)))
+            hit_index = i;
+    }
+    return hit_index;
+}
+#endif
+
+// closest hit over all entities, hit_index receives the index into ENTITY
+static inline hit_record_geometry hit_scene(ray r, size_t *hit_index)
+{
+    hit_record_geometry closest = {.t = -1.0};
+#ifdef USE_SIMD
+    *hit_index = bvh_closest_hit(&BVH, r, &closest, soa_hit_leaf, &SOA);
+    if (*hit_index != BVH_NO_HIT && !soa_full_record(&SOA, *hit_index))
+    {
+        // the kernels only track t, rebuild the record of the winner
+        closest = soa_record(&SOA, *hit_index, r, closest.t);
+    }
+#else
+    *hit_index = bvh_closest_hit(&BVH, r, &closest, hit_entity_leaf, ENTITY);
+#endif
+    return closest;
+}
+
+#ifndef USE_SIMD
+static bool occluded_entity_leaf(const void *ctx, const bvh_node *leaf, size_t node_index,
+                                 ray r, real t_max)
+{
+    const entity *ents = ctx;
+    for (size_t i = leaf->left_first; i < leaf->left_first + leaf->count; ++i)
+    {
+        if (occluded_geometry(ents[i].geo, r, t_max))
+            return true;
+    }
+    return false;
+}
+#endif
+
+// any hit closer than t_max, for shadow and visibility rays
+static inline bool occluded_scene(ray r, real t_max)
+{
+    STATS_INC(STAT_SHADOW_RAYS);
+#ifdef USE_SIMD
+    return bvh_any_hit(&BVH, r, t_max, soa_occluded_leaf, &SOA);
+#else
+    return bvh_any_hit(&BVH, r, t_max, occluded_entity_leaf, ENTITY);
+#endif
+}
+
+// emissive entities, indices into ENTITY
+static size_t *LIGHT;
+static size_t LIGHT_NUM;
+
+// a shadow ray is blocked by hits closer than this fraction of the distance to the light
+#define SHADOW_RAY_MARGIN REAL(1e-3)
+
+// collect the lights, after the bvh has reordered ENTITY
+static void build_scene_lights()
+{
+    LIGHT = malloc(sizeof(size_t) * (ENTITY_NUM > 0 ? ENTITY_NUM : 1));
+    LIGHT_NUM = 0;
+    for (size_t i = 0; i < ENTITY_NUM; ++i)
+    {
+        if (is_emissive_material(*entity_material(i)))
+        {
+            // the first area query prepares a mesh light for sampling, see area_mesh
+            area_geometry(ENTITY[i].geo);
+            LIGHT[LIGHT_NUM++] = i;
+        }
+    }
+}
+
+// next-event estimation at a diffuse hit: a shadow ray to a uniform point on a random light.
+// returns emitted * cos_surface * cos_light / (distance^2 * pdf), the caller applies albedo / pi
+static color direct_light(hit_record_geometry rec, unsigned int *state)
+{
+    color none = vec3_make(0.0, 0.0, 0.0);
+    if (LIGHT_NUM == 0)
+        return none;
+
+    size_t pick = (size_t)(rand_unit(state) * LIGHT_NUM);
+    size_t light = LIGHT[pick < LIGHT_NUM ? pick : LIGHT_NUM - 1];
+    vec3 light_normal;
+    point y = sample_geometry(ENTITY[light].geo, state, &light_normal);
+    point x = point_of_hit(rec);
+
+    // the normal on the side the ray came from
+    vec3 normal = vec3_dot(rec.r.direction, rec.normal) > REAL(0.0) ? vec3_inv(rec.normal) : rec.normal;
+    vec3 to_light = vec3_sub(y, x);
+    real dist2 = vec3_dot(to_light, to_light);
+    if (!(dist2 > REAL(0.0)))
+        return none;
+    real dist = sqrt(dist2);
+    vec3 wi = vec3_scale(to_light, REAL(1.0) / dist);
+    real cos_surface = vec3_dot(normal, wi);
+    real cos_light = -vec3_dot(light_normal, wi);
+    if (cos_surface <= REAL(0.0) || cos_light <= REAL(0.0))
+        return none;
+
+    // the light itself cannot block: the sampled point faces x and the light is convex or flat
+    if (occluded_scene(ray_make(x, wi), dist * (REAL(1.0) - SHADOW_RAY_MARGIN)))
+        return none;
+
+    real pdf = REAL(1.0) / (LIGHT_NUM * area_geometry(ENTITY[light].geo));
+    return vec3_scale(emitted_material(*entity_material(light)), cos_surface * cos_light / (dist2 * pdf));
+}
+
+// closest hit of every active ray of a packet
+static inline void hit_scene_packet(const ray *rays, const bool *active, size_t n,
+                                    hit_record_geometry *closest, size_t *hit_index)
+{
+#ifdef USE_SIMD
+    bvh_closest_hit_packet(&BVH, rays, active, n, closest, hit_index, soa_hit_leaf, &SOA);
+    for (size_t k = 0; k < n; ++k)
+    {
+        if (active[k] && hit_index[k] != BVH_NO_HIT && !soa_full_record(&SOA, hit_index[k]))
+            closest[k] = soa_record(&SOA, hit_index[k], rays[k], closest[k].t);
+    }
+#else
+    bvh_closest_hit_packet(&BVH, rays, active, n, closest, hit_index, hit_entity_leaf, ENTITY);
+#endif
+}
+
+// build the hierarchy and reorder ENTITY so that every leaf is a contiguous range
+static void build_scene_bvh()
+{
+    aabb *bounds = malloc(sizeof(aabb) * (ENTITY_NUM > 0 ? ENTITY_NUM : 1));
+    for (size_t i = 0; i < ENTITY_NUM; ++i)
+    {
+        bounds[i] = bounds_geometry(ENTITY[i].geo);
+    }
+    bvh_build(&BVH, bounds, ENTITY_NUM);
+    free(bounds);
+
+    entity *sorted = malloc(sizeof(entity) * (ENTITY_NUM > 0 ? ENTITY_NUM : 1));
+    for (size_t i = 0; i < ENTITY_NUM; ++i)
+    {
+        sorted[i] = ENTITY[BVH.index[i]];
+    }
+    free(ENTITY);
+    ENTITY = sorted;
+
+#ifdef USE_SIMD
+    soa_build(&SOA, &BVH, ENTITY, ENTITY_NUM);
+#endif
+}
+
+// the geometry of a define, made once and shared by all of its instances
+static const geometry_union *definition_geometry(parse_definition *def)
+{
+    if (!def->built)
+    {
+        geometry_union *g = malloc(sizeof(geometry_union));
+        g->type = def->geo_type;
+        switch (def->geo_type)
+        {
+        case SPHERE:
+            g->geometry.s = def->sph;
+            break;
+        case TRIANGLE:
+            g->geometry.t = triangle_precompute(def->tri);
+            break;
+        case MESH:
+            g->geometry.m = def->msh;
+            break;
+        default:
+            break;
+        }
+        def->built = g;
+    }
+    return def->built;
+}
 
 void setup_scene()
 {
     CAMERA_ORIGIN = vec3_make(0.0, 0.0, 0.0);
-    HORIZONTAL = vec3_make(VIEWPORT_WIDTH, 0.0, 0.0);
+    HORIZONTAL = vec3_make(VIEWPORT_HEIGHT * CONFIG.width / CONFIG.height, 0.0, 0.0);
     VERTICAL = vec3_make(0.0, VIEWPORT_HEIGHT, 0.0);
 
     // (horizontal + vertical)/2 + (0, 0, focal_length)
@@ -33,8 +233,21 @@ void setup_scene()
         CAMERA_ORIGIN,
         lower_left_corner_vector);
 
-    size_t entity_count = setup_file();
+    if (CONFIG.scene_cache[0] != '\0' &&
+        scene_cache_load(CONFIG.scene_cache, CONFIG.scene, &ENTITY, &ENTITY_NUM, &MATERIAL, &MATERIAL_NUM, &BVH))
+    {
+#ifdef USE_SIMD
+        soa_build(&SOA, &BVH, ENTITY, ENTITY_NUM);
+#endif
+        build_scene_lights();
+        return;
+    }
+
+    parse_quiet = CONFIG.quiet;
+    mesh_quiet = CONFIG.quiet;
+    size_t entity_count = setup_file(CONFIG.scene);
     ENTITY = malloc(sizeof(entity) * entity_count);
+    MATERIAL = malloc(sizeof(material_union) * (entity_count > 0 ? entity_count : 1));
 
     result res;
     while (parse_line(&res))
@@ -47,29 +260,51 @@ void setup_scene()
             e.geo.geometry.s = res.sph;
             break;
         case TRIANGLE:
-            e.geo.geometry.t = res.tri;
+            e.geo.geometry.t = triangle_precompute(res.tri);
+            break;
+        case MESH:
+            e.geo.geometry.m = res.msh;
+            break;
+        case INSTANCE:
+            e.geo.geometry.i = instance_make(definition_geometry(res.inst_def), res.inst_xf);
             break;
         default:
             break;
         }
 
-        e.mat.type = res.mat_type;
+        // zeroed so that the padding compares equal too
+        material_union mu;
+        memset(&mu, 0, sizeof(mu));
+        mu.type = res.mat_type;
         switch (res.mat_type)
         {
         case METAL:
-            e.mat.material.m = res.met;
+            mu.material.m = res.met;
             break;
         case LAMBERTIAN:
-            e.mat.material.l = res.lam;
+            mu.material.l = res.lam;
             break;
         case DIELECTRIC:
-            e.mat.material.d = res.die;
+            mu.material.d = res.die;
+            break;
+        case EMISSIVE:
+            mu.material.e = res.emi;
             break;
         default:
             break;
         }
+        // runs of one material (meshes, generated scenes) share a table entry
+        if (MATERIAL_NUM == 0 || memcmp(&MATERIAL[MATERIAL_NUM - 1], &mu, sizeof(mu)) != 0)
+            MATERIAL[MATERIAL_NUM++] = mu;
+        e.material = MATERIAL_NUM - 1;
         ENTITY[ENTITY_NUM++] = e;
     }
+    MATERIAL = realloc(MATERIAL, sizeof(material_union) * (MATERIAL_NUM > 0 ? MATERIAL_NUM : 1));
+
+    build_scene_bvh();
+    if (CONFIG.scene_cache[0] != '\0')
+        scene_cache_save(CONFIG.scene_cache, CONFIG.scene, ENTITY, ENTITY_NUM, MATERIAL, MATERIAL_NUM, &BVH);
+    build_scene_lights();
 }
 
 #endif
\ No newline at end of file
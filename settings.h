@@ -1,11 +1,31 @@
+// defaults of the runtime settings in config.h
 #define WIDTH 128
 #define HEIGHT 128
+#define SAMPLING 128
+#define MAX_REFLECTION_DEPTH 5
+#define CONFIG_MAX_DEPTH 1024 // hit materials of a backward path are kept on the stack, also the forward default
+#define SCENE_FILENAME "scene.txt"
+#define ADAPTIVE_MIN_SAMPLES 16 // with --noise, every pixel takes at least this many samples
+#define RR_MIN_DEPTH 3 // the forward integrator starts Russian roulette after this many bounces
 
+// the viewport width follows the aspect ratio of the image
 #define VIEWPORT_HEIGHT 2.0
-#define VIEWPORT_WIDTH 2.0
 #define FOCAL_LENGTH 1.0
 
-#define SAMPLING 128
-#define MAX_REFLECTION_DEPTH 5
-
 #define RANDOM_SEED_GLOBAL 0x12345678
+#define FRAME 0 // mixed into every random stream, change it to get an independent image
+
+// side of the square tiles handed to render threads, a multiple of PACKET_TILE; --tile overrides it
+#ifndef TILE_SIZE
+#define TILE_SIZE 16
+#endif
+
+// trace camera rays of PACKET_TILE x PACKET_TILE pixels together (4 or 8), 0 traces every ray alone
+#ifndef PACKET_TILE
+#define PACKET_TILE 0
+#endif
+
+// trace WAVEFRONT_SIZE paths of a tile stage by stage (ray_tracing_comb_omp), 0 traces path by path
+#ifndef WAVEFRONT_SIZE
+#define WAVEFRONT_SIZE 0
+#endif
@@ -0,0 +1,116 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+// 1 本の ray を複数のプリミティブに同時に当てるための薄いラッパー。
+// -mavx2 なら 4 レーン、そうでなければ SSE2 の 2 レーンになる。
+// USE_FLOAT のときはそれぞれ 8 レーンと 4 レーン。
+
+#include "utils.h"
+
+#if defined(USE_FLOAT) && defined(__AVX2__)
+#include <immintrin.h>
+
+#define SIMD_WIDTH 8
+
+typedef __m256 simd_real;
+
+#define simd_set1(a) _mm256_set1_ps(a)
+#define simd_load(p) _mm256_loadu_ps(p)
+#define simd_store(p, a) _mm256_storeu_ps(p, a)
+#define simd_add(a, b) _mm256_add_ps(a, b)
+#define simd_sub(a, b) _mm256_sub_ps(a, b)
+#define simd_mul(a, b) _mm256_mul_ps(a, b)
+#define simd_div(a, b) _mm256_div_ps(a, b)
+#define simd_sqrt(a) _mm256_sqrt_ps(a)
+#define simd_and(a, b) _mm256_and_ps(a, b)
+#define simd_or(a, b) _mm256_or_ps(a, b)
+#define simd_lt(a, b) _mm256_cmp_ps(a, b, _CMP_LT_OQ)
+#define simd_le(a, b) _mm256_cmp_ps(a, b, _CMP_LE_OQ)
+#define simd_ge(a, b) _mm256_cmp_ps(a, b, _CMP_GE_OQ)
+#define simd_gt(a, b) _mm256_cmp_ps(a, b, _CMP_GT_OQ)
+#define simd_movemask(a) _mm256_movemask_ps(a)
+#define simd_iota() _mm256_set_ps(7.0f, 6.0f, 5.0f, 4.0f, 3.0f, 2.0f, 1.0f, 0.0f)
+
+#elif defined(USE_FLOAT) && defined(__SSE2__)
+#include <emmintrin.h>
+
+#define SIMD_WIDTH 4
+
+typedef __m128 simd_real;
+
+#define simd_set1(a) _mm_set1_ps(a)
+#define simd_load(p) _mm_loadu_ps(p)
+#define simd_store(p, a) _mm_storeu_ps(p, a)
+#define simd_add(a, b) _mm_add_ps(a, b)
+#define simd_sub(a, b) _mm_sub_ps(a, b)
+#define simd_mul(a, b) _mm_mul_ps(a, b)
+#define simd_div(a, b) _mm_div_ps(a, b)
+#define simd_sqrt(a) _mm_sqrt_ps(a)
+#define simd_and(a, b) _mm_and_ps(a, b)
+#define simd_or(a, b) _mm_or_ps(a, b)
+#define simd_lt(a, b) _mm_cmplt_ps(a, b)
+#define simd_le(a, b) _mm_cmple_ps(a, b)
+#define simd_ge(a, b) _mm_cmpge_ps(a, b)
+#define simd_gt(a, b) _mm_cmpgt_ps(a, b)
+#define simd_movemask(a) _mm_movemask_ps(a)
+#define simd_iota() _mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f)
+
+#elif defined(__AVX2__)
+#include <immintrin.h>
+
+#define SIMD_WIDTH 4
+
+typedef __m256d simd_real;
+
+#define simd_set1(a) _mm256_set1_pd(a)
+#define simd_load(p) _mm256_loadu_pd(p)
+#define simd_store(p, a) _mm256_storeu_pd(p, a)
+#define simd_add(a, b) _mm256_add_pd(a, b)
+#define simd_sub(a, b) _mm256_sub_pd(a, b)
+#define simd_mul(a, b) _mm256_mul_pd(a, b)
+#define simd_div(a, b) _mm256_div_pd(a, b)
+#define simd_sqrt(a) _mm256_sqrt_pd(a)
+#define simd_and(a, b) _mm256_and_pd(a, b)
+#define simd_or(a, b) _mm256_or_pd(a, b)
+#define simd_lt(a, b) _mm256_cmp_pd(a, b, _CMP_LT_OQ)
+#define simd_le(a, b) _mm256_cmp_pd(a, b, _CMP_LE_OQ)
+#define simd_ge(a, b) _mm256_cmp_pd(a, b, _CMP_GE_OQ)
+#define simd_gt(a, b) _mm256_cmp_pd(a, b, _CMP_GT_OQ)
+#define simd_movemask(a) _mm256_movemask_pd(a)
+#define simd_iota() _mm256_set_pd(3.0, 2.0, 1.0, 0.0)
+
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+
+#define SIMD_WIDTH 2
+
+typedef __m128d simd_real;
+
+#define simd_set1(a) _mm_set1_pd(a)
+#define simd_load(p) _mm_loadu_pd(p)
+#define simd_store(p, a) _mm_storeu_pd(p, a)
+#define simd_add(a, b) _mm_add_pd(a, b)
+#define simd_sub(a, b) _mm_sub_pd(a, b)
+#define simd_mul(a, b) _mm_mul_pd(a, b)
+#define simd_div(a, b) _mm_div_pd(a, b)
+#define simd_sqrt(a) _mm_sqrt_pd(a)
+#define simd_and(a, b) _mm_and_pd(a, b)
+#define simd_or(a, b) _mm_or_pd(a, b)
+#define simd_lt(a, b) _mm_cmplt_pd(a, b)
+#define simd_le(a, b) _mm_cmple_pd(a, b)
+#define simd_ge(a, b) _mm_cmpge_pd(a, b)
+#define simd_gt(a, b) _mm_cmpgt_pd(a, b)
+#define simd_movemask(a) _mm_movemask_pd(a)
+#define simd_iota() _mm_set_pd(1.0, 0.0)
+
+#else
+#error "simd.h needs SSE2 or AVX2"
+#endif
+
+// lanes [0, n) are set
+static inline simd_real simd_first_lanes(size_t n)
+{
+    return simd_lt(simd_iota(), simd_set1((real)n));
+}
+
+#endif
@@ -0,0 +1,110 @@
+#ifndef STATS_H
+#define STATS_H
+
+// 描画の内側で何が何回起きたかを数える。-DRT_STATS のときだけ有効で、
+// それ以外では STATS_* は何も残さない。
+// カウンタはスレッドごと (_Thread_local) に持ち、stats_merge で全体の和に足してから stats_report で表示する。
+// "rays" と "rays per depth" の行は bench.c が読むので、形式を変えるときは一緒に直すこと。
+
+#include <stdio.h>
+#include <stddef.h>
+#include "settings.h"
+
+typedef enum
+{
+    STAT_SPHERE_TESTS,
+    STAT_TRIANGLE_TESTS,
+    STAT_MESH_TRIANGLE_TESTS,
+    STAT_INSTANCE_RAYS, // rays moved into the space of an instance
+    // path vertices by material, in material_type order
+    STAT_METAL_HITS,
+    STAT_LAMBERTIAN_HITS,
+    STAT_DIELECTRIC_HITS,
+    STAT_EMISSIVE_HITS,
+    STAT_ESCAPES, // paths that left the scene before the maximum depth
+    STAT_SHADOW_RAYS,
+    STAT_NUM,
+} stat_counter;
+
+#ifdef RT_STATS
+
+typedef struct
+{
+    size_t count[STAT_NUM];
+    size_t path_length[CONFIG_MAX_DEPTH + 1]; // paths by the number of rays they traced
+} rt_stats;
+
+static _Thread_local rt_stats STATS_LOCAL;
+static rt_stats STATS_TOTAL;
+
+#define STATS_INC(counter) (STATS_LOCAL.count[counter]++)
+#define STATS_ADD(counter, n) (STATS_LOCAL.count[counter] += (n))
+#define STATS_PATH(rays) (STATS_LOCAL.path_length[rays]++)
+
+// add the counters of the calling thread to the total, every render thread calls it when done
+static void stats_merge(void)
+{
+#pragma omp critical(stats_merge)
+    {
+        for (int i = 0; i < STAT_NUM; ++i)
+        {
+            STATS_TOTAL.count[i] += STATS_LOCAL.count[i];
+        }
+        for (int i = 0; i <= CONFIG_MAX_DEPTH; ++i)
+        {
+            STATS_TOTAL.path_length[i] += STATS_LOCAL.path_length[i];
+        }
+    }
+    STATS_LOCAL = (rt_stats){0};
+}
+
+// sec is the render time, the ray rate is taken over it
+static void stats_report(double sec)
+{
+    const size_t *c = STATS_TOTAL.count;
+    size_t primary = 0, secondary = 0;
+    int longest = 0;
+    for (int n = 1; n <= CONFIG_MAX_DEPTH; ++n)
+    {
+        primary += STATS_TOTAL.path_length[n];
+        secondary += (n - 1) * STATS_TOTAL.path_length[n];
+        if (STATS_TOTAL.path_length[n] > 0)
+            longest = n;
+    }
+
+    // a path of n rays reached every depth below n
+    printf("rays %zu, %f Mrays/sec\n", primary + secondary, sec > 0.0 ? (primary + secondary) / sec * 1e-6 : 0.0);
+    printf("rays per depth");
+    size_t deeper = primary;
+    for (int n = 1; n <= longest; ++n)
+    {
+        printf(" %zu", deeper);
+        deeper -= STATS_TOTAL.path_length[n];
+    }
+    printf("\n");
+    printf("stats: rays primary %zu, secondary %zu, shadow %zu\n", primary, secondary, c[STAT_SHADOW_RAYS]);
+    printf("stats: tests sphere %zu, triangle %zu, mesh triangle %zu, instance rays %zu\n",
+           c[STAT_SPHERE_TESTS], c[STAT_TRIANGLE_TESTS], c[STAT_MESH_TRIANGLE_TESTS], c[STAT_INSTANCE_RAYS]);
+    printf("stats: hits metal %zu, lambertian %zu, dielectric %zu, emissive %zu, escapes %zu\n",
+           c[STAT_METAL_HITS], c[STAT_LAMBERTIAN_HITS], c[STAT_DIELECTRIC_HITS], c[STAT_EMISSIVE_HITS],
+           c[STAT_ESCAPES]);
+    printf("stats: path length");
+    for (int n = 1; n <= longest; ++n)
+    {
+        printf(" %d:%zu", n, STATS_TOTAL.path_length[n]);
+    }
+    printf("\n");
+}
+
+#else
+
+#define STATS_INC(counter) ((void)0)
+#define STATS_ADD(counter, n) ((void)0)
+#define STATS_PATH(rays) ((void)0)
+
+static inline void stats_merge(void) {}
+static inline void stats_report(double sec) { (void)sec; }
+
+#endif
+
+#endif
@@ -0,0 +1,125 @@
+#ifndef TILE_H
+#define TILE_H
+
+// 画像を tile_size 四方のタイルに分け、スレッドが空いた順にタイルを取っていく。
+// タイルは Morton (Z 曲線) 順に並べておき、続けて取られるタイルが画面上でも近くなるようにする。
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/time.h> // for time
+#include "utils.h"
+
+typedef struct
+{
+    int x0, y0; // inclusive
+    int x1, y1; // exclusive
+} tile;
+
+typedef struct
+{
+    int width, height;
+    int tile_size;
+    int tiles_x, tiles_y;
+    size_t tile_num;
+    uint32_t *order; // tile index (ty * tiles_x + tx) in dispatch order
+    size_t next;     // next position in order, taken atomically
+} tile_scheduler;
+
+// time spent by one thread inside tiles
+typedef struct
+{
+    double busy_sec;
+    size_t tiles;
+    size_t pixels;
+} tile_thread_stats;
+
+// interleave the lower 16 bits of x and y
+static uint32_t morton_code(uint32_t x, uint32_t y)
+{
+    uint32_t code = 0;
+    for (int i = 0; i < 16; ++i)
+    {
+        code |= ((x >> i) & 1u) << (2 * i);
+        code |= ((y >> i) & 1u) << (2 * i + 1);
+    }
+    return code;
+}
+
+static int compare_morton(const void *a, const void *b)
+{
+    const uint64_t *ka = a;
+    const uint64_t *kb = b;
+    return (*ka > *kb) - (*ka < *kb);
+}
+
+void tile_scheduler_init(tile_scheduler *s, int width, int height, int tile_size)
+{
+    s->width = width;
+    s->height = height;
+    s->tile_size = tile_size;
+    s->tiles_x = (width + tile_size - 1) / tile_size;
+    s->tiles_y = (height + tile_size - 1) / tile_size;
+    s->tile_num = (size_t)s->tiles_x * s->tiles_y;
+    s->order = malloc(sizeof(uint32_t) * (s->tile_num > 0 ? s->tile_num : 1));
+    s->next = 0;
+
+    // sort by (morton code, tile index) packed into one key
+    uint64_t *keys = malloc(sizeof(uint64_t) * (s->tile_num > 0 ? s->tile_num : 1));
+    for (int ty = 0; ty < s->tiles_y; ++ty)
+        for (int tx = 0; tx < s->tiles_x; ++tx)
+        {
+            uint32_t index = ty * s->tiles_x + tx;
+            keys[index] = ((uint64_t)morton_code(tx, ty) << 32) | index;
+        }
+    qsort(keys, s->tile_num, sizeof(uint64_t), compare_morton);
+    for (size_t i = 0; i < s->tile_num; ++i)
+    {
+        s->order[i] = (uint32_t)keys[i];
+    }
+    free(keys);
+}
+
+void tile_scheduler_free(tile_scheduler *s)
+{
+    free(s->order);
+    s->order = NULL;
+}
+
+// take the next tile, safe to call from any thread
+bool tile_next(tile_scheduler *s, tile *t)
+{
+    size_t i;
+#pragma omp atomic capture
+    i = s->next++;
+
+    if (i >= s->tile_num)
+        return false;
+
+    int index = s->order[i];
+    int tx = index % s->tiles_x;
+    int ty = index / s->tiles_x;
+    t->x0 = tx * s->tile_size;
+    t->y0 = ty * s->tile_size;
+    t->x1 = t->x0 + s->tile_size < s->width ? t->x0 + s->tile_size : s->width;
+    t->y1 = t->y0 + s->tile_size < s->height ? t->y0 + s->tile_size : s->height;
+    return true;
+}
+
+void tile_report(const tile_thread_stats *stats, int thread_num)
+{
+    double sum = 0.0, max = 0.0;
+    for (int i = 0; i < thread_num; ++i)
+    {
+        printf("thread %d: %f sec, %zu tiles, %zu pixels\n",
+               i, stats[i].busy_sec, stats[i].tiles, stats[i].pixels);
+        sum += stats[i].busy_sec;
+        if (stats[i].busy_sec > max)
+            max = stats[i].busy_sec;
+    }
+    double mean = thread_num > 0 ? sum / thread_num : 0.0;
+    printf("load imbalance (max / mean busy time) %f\n", mean > 0.0 ? max / mean : 1.0);
+}
+
+#endif
@@ -0,0 +1,109 @@
+#ifndef TRANSFORM_H
+#define TRANSFORM_H
+
+// アフィン変換 (3x3 の線形部分と平行移動)。インスタンスの配置に使う。
+
+#include <stdbool.h>
+#include <math.h>
+#include "vec3.h"
+#include "component.h"
+
+typedef struct
+{
+    real m[3][4]; // rows, column 3 is the translation
+} affine;
+
+// uniform scale, then a rotation about y by yaw degrees, then a translation
+affine affine_place(vec3 translate, real scale, real yaw_degrees)
+{
+    real yaw = yaw_degrees * MY_PI / REAL(180.0);
+    real c = cos(yaw) * scale, s = sin(yaw) * scale;
+    affine a = {{{c, 0.0, s, translate.x}, {0.0, scale, 0.0, translate.y}, {-s, 0.0, c, translate.z}}};
+    return a;
+}
+
+static inline point affine_point(const affine *a, point p)
+{
+    return vec3_make(a->m[0][0] * p.x + a->m[0][1] * p.y + a->m[0][2] * p.z + a->m[0][3],
+                     a->m[1][0] * p.x + a->m[1][1] * p.y + a->m[1][2] * p.z + a->m[1][3],
+                     a->m[2][0] * p.x + a->m[2][1] * p.y + a->m[2][2] * p.z + a->m[2][3]);
+}
+
+static inline vec3 affine_vector(const affine *a, vec3 v)
+{
+    return vec3_make(a->m[0][0] * v.x + a->m[0][1] * v.y + a->m[0][2] * v.z,
+                     a->m[1][0] * v.x + a->m[1][1] * v.y + a->m[1][2] * v.z,
+                     a->m[2][0] * v.x + a->m[2][1] * v.y + a->m[2][2] * v.z);
+}
+
+// normals go through the transpose of the inverse, inv is the inverse of the placement
+static inline vec3 affine_normal(const affine *inv, vec3 n)
+{
+    return vec3_unit(vec3_make(inv->m[0][0] * n.x + inv->m[1][0] * n.y + inv->m[2][0] * n.z,
+                               inv->m[0][1] * n.x + inv->m[1][1] * n.y + inv->m[2][1] * n.z,
+                               inv->m[0][2] * n.x + inv->m[1][2] * n.y + inv->m[2][2] * n.z));
+}
+
+real affine_det(const affine *a)
+{
+    return a->m[0][0] * (a->m[1][1] * a->m[2][2] - a->m[1][2] * a->m[2][1]) -
+           a->m[0][1] * (a->m[1][0] * a->m[2][2] - a->m[1][2] * a->m[2][0]) +
+           a->m[0][2] * (a->m[1][0] * a->m[2][1] - a->m[1][1] * a->m[2][0]);
+}
+
+// true when the linear part is a rotation (or reflection) times a uniform scale,
+// the only placements that scale every area by the same |det|^(2/3)
+bool affine_is_similarity(const affine *a)
+{
+    real g[3][3]; // columns dotted with each other
+    for (int i = 0; i < 3; ++i)
+        for (int j = 0; j < 3; ++j)
+            g[i][j] = a->m[0][i] * a->m[0][j] + a->m[1][i] * a->m[1][j] + a->m[2][i] * a->m[2][j];
+    real s2 = (g[0][0] + g[1][1] + g[2][2]) / REAL(3.0);
+    real tol = REAL(1e-4) * s2;
+    return fabs(g[0][0] - s2) <= tol && fabs(g[1][1] - s2) <= tol && fabs(g[2][2] - s2) <= tol &&
+           fabs(g[0][1]) <= tol && fabs(g[0][2]) <= tol && fabs(g[1][2]) <= tol;
+}
+
+// false when the linear part is singular
+bool affine_inverse(const affine *a, affine *inv)
+{
+    real det = affine_det(a);
+    if (fabs(det) < REAL(1e-12))
+        return false;
+    real d = REAL(1.0) / det;
+    const real(*m)[4] = a->m;
+
+    inv->m[0][0] = (m[1][1] * m[2][2] - m[1][2] * m[2][1]) * d;
+    inv->m[0][1] = (m[0][2] * m[2][1] - m[0][1] * m[2][2]) * d;
+    inv->m[0][2] = (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * d;
+    inv->m[1][0] = (m[1][2] * m[2][0] - m[1][0] * m[2][2]) * d;
+    inv->m[1][1] = (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * d;
+    inv->m[1][2] = (m[0][2] * m[1][0] - m[0][0] * m[1][2]) * d;
+    inv->m[2][0] = (m[1][0] * m[2][1] - m[1][1] * m[2][0]) * d;
+    inv->m[2][1] = (m[0][1] * m[2][0] - m[0][0] * m[2][1]) * d;
+    inv->m[2][2] = (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * d;
+
+    // translation: -inverse(linear) * t
+    for (int i = 0; i < 3; ++i)
+    {
+        inv->m[i][3] = -(inv->m[i][0] * m[0][3] + inv->m[i][1] * m[1][3] + inv->m[i][2] * m[2][3]);
+    }
+    return true;
+}
+
+// box around the eight transformed corners
+static inline aabb affine_bounds(const affine *a, aabb box)
+{
+    aabb out = aabb_empty();
+    for (int k = 0; k < 8; ++k)
+    {
+        point corner = vec3_make(k & 1 ? box.max.x : box.min.x,
+                                 k & 2 ? box.max.y : box.min.y,
+                                 k & 4 ? box.max.z : box.min.z);
+        out = aabb_extend(out, affine_point(a, corner));
+    }
+    return out;
+}
+
+#endif
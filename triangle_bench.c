@@ -0,0 +1,186 @@
+// 三角形の交差判定のマイクロベンチマーク。
+// 毎回辺を計算する hit_triangle (比べるためだけにここに置く) と、前計算した triangle_pre を使う hit_triangle_pre を
+// 同じ三角形と ray の組で走らせ、1 秒あたりの判定回数を比べる。
+//   triangle_bench [triangles] [rays] [repeat]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h> // for time
+#include "vec3.h"
+#include "component.h"
+#include "utils.h"
+#include "settings.h"
+
+#define BENCH_TRIANGLES 1024
+#define BENCH_RAYS 4096
+#define BENCH_REPEAT 8
+
+static point random_point(unsigned int *state)
+{
+    return vec3_make(rand_range(state, -1.0, 1.0), rand_range(state, -1.0, 1.0), rand_range(state, -1.0, 1.0));
+}
+
+// small triangles scattered in [-1, 1]^3, about half of them face a given ray
+static triangle random_triangle(unsigned int *state)
+{
+    point center = random_point(state);
+    triangle tri;
+    tri.a = vec3_add(center, vec3_scale(random_point(state), 0.2));
+    tri.b = vec3_add(center, vec3_scale(random_point(state), 0.2));
+    tri.c = vec3_add(center, vec3_scale(random_point(state), 0.2));
+    return tri;
+}
+
+// rays from a sphere of radius 3 toward a random point in the cube
+static ray random_ray(unsigned int *state)
+{
+    point origin = vec3_scale(random_unit_vector(state), 3.0);
+    return ray_make(origin, vec3_sub(random_point(state), origin));
+}
+
+// the kernel before triangle_pre: the edges and the normal are computed on every test
+static hit_record_geometry hit_triangle(const triangle *tri, ray ry)
+{
+    hit_record_geometry rec;
+    rec.t = -1.0;
+
+    vec3 ab = vec3_sub(tri->b, tri->a);
+    vec3 ac = vec3_sub(tri->c, tri->a);
+    vec3 pvec = vec3_cross(ry.direction, ac);
+    real det = vec3_dot(ab, pvec);
+
+    if (det < TRIANGLE_DET_EPSILON)
+        return rec;
+
+    real inv_det = 1.0 / det;
+
+    vec3 tvec = vec3_sub(ry.origin, tri->a);
+    real u = inv_det * vec3_dot(tvec, pvec);
+
+    if (u < 0.0 || u > 1.0)
+        return rec;
+
+    vec3 qvec = vec3_cross(tvec, ab);
+    real v = inv_det * vec3_dot(ry.direction, qvec);
+
+    if (v < 0.0 || u + v > 1.0)
+        return rec;
+
+    real t = inv_det * vec3_dot(ac, qvec);
+
+    if (t < HIT_EPSILON)
+        return rec;
+
+    rec.t = t;
+    rec.r = ry;
+    rec.normal = vec3_unit(vec3_cross(ab, ac));
+
+    return rec;
+}
+
+typedef struct
+{
+    double sec;
+    size_t hits;
+    double t_sum; // keeps the results alive and lets the two kernels be compared
+} bench_result;
+
+static bench_result bench_plain(const triangle *tris, size_t tri_num, const ray *rays, size_t ray_num, int repeat)
+{
+    bench_result res = {0};
+    struct timeval t1, t2;
+    gettimeofday(&t1, NULL);
+    for (int k = 0; k < repeat; ++k)
+        for (size_t r = 0; r < ray_num; ++r)
+            for (size_t i = 0; i < tri_num; ++i)
+            {
+                hit_record_geometry rec = hit_triangle(&tris[i], rays[r]);
+                if (rec.t >= 0.0)
+                {
+                    res.hits++;
+                    res.t_sum += rec.t + rec.normal.x;
+                }
+            }
+    gettimeofday(&t2, NULL);
+    res.sec = time_diff_sec(t1, t2);
+    return res;
+}
+
+static bench_result bench_pre(triangle_pre *tris, size_t tri_num, const ray *rays, size_t ray_num, int repeat)
+{
+    bench_result res = {0};
+    struct timeval t1, t2;
+    gettimeofday(&t1, NULL);
+    for (int k = 0; k < repeat; ++k)
+        for (size_t r = 0; r < ray_num; ++r)
+            for (size_t i = 0; i < tri_num; ++i)
+            {
+                hit_record_geometry rec = hit_triangle_pre(&tris[i], rays[r]);
+                if (rec.t >= 0.0)
+                {
+                    res.hits++;
+                    res.t_sum += rec.t + rec.normal.x;
+                }
+            }
+    gettimeofday(&t2, NULL);
+    res.sec = time_diff_sec(t1, t2);
+    return res;
+}
+
+static void report(const char *name, bench_result res, double tests)
+{
+    printf("%-16s %f sec, %.2f M tests/sec, %zu hits\n", name, res.sec, tests / res.sec * 1e-6, res.hits);
+}
+
+int main(int argc, char *argv[])
+{
+    size_t tri_num = argc > 1 ? strtoul(argv[1], NULL, 10) : BENCH_TRIANGLES;
+    size_t ray_num = argc > 2 ? strtoul(argv[2], NULL, 10) : BENCH_RAYS;
+    int repeat = argc > 3 ? atoi(argv[3]) : BENCH_REPEAT;
+    if (tri_num == 0 || ray_num == 0 || repeat <= 0)
+    {
+        fprintf(stderr, "usage: %s [triangles] [rays] [repeat]\n", argv[0]);
+        return 1;
+    }
+
+    unsigned int state = RANDOM_SEED_GLOBAL;
+    triangle *tris = malloc(sizeof(triangle) * tri_num);
+    triangle_pre *pres = malloc(sizeof(triangle_pre) * tri_num);
+    ray *rays = malloc(sizeof(ray) * ray_num);
+    for (size_t i = 0; i < tri_num; ++i)
+    {
+        tris[i] = random_triangle(&state);
+        pres[i] = triangle_precompute(tris[i]);
+    }
+    for (size_t r = 0; r < ray_num; ++r)
+    {
+        rays[r] = random_ray(&state);
+    }
+
+    double tests = (double)tri_num * ray_num * repeat;
+    printf("%zu triangles x %zu rays x %d\n", tri_num, ray_num, repeat);
+
+    // warm up the caches and the branch predictors once for each kernel
+    size_t warm_num = ray_num < 64 ? ray_num : 64;
+    bench_plain(tris, tri_num, rays, warm_num, 1);
+    bench_pre(pres, tri_num, rays, warm_num, 1);
+    bench_result plain = bench_plain(tris, tri_num, rays, ray_num, repeat);
+    bench_result pre = bench_pre(pres, tri_num, rays, ray_num, repeat);
+
+    report("hit_triangle", plain, tests);
+    report("hit_triangle_pre", pre, tests);
+    printf("speedup %f\n", plain.sec / pre.sec);
+
+    int status = 0;
+    if (plain.hits != pre.hits || plain.t_sum != pre.t_sum)
+    {
+        fprintf(stderr, "results differ: %zu hits / %f and %zu hits / %f\n",
+                plain.hits, plain.t_sum, pre.hits, pre.t_sum);
+        status = 1;
+    }
+
+    free(tris);
+    free(pres);
+    free(rays);
+    return status;
+}
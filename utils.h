@@ -2,13 +2,52 @@
 #define UTILS_H
 
 #include <sys/time.h> // for time
-#include <math.h>
+#include <tgmath.h> // sqrt and the others follow real, so the float build stays in float
 #include <limits.h> // UINT_MAX
 
 // pi 
-#define MY_PI 3.14159265358979323846
+#define MY_PI REAL(3.14159265358979323846)
+
+// ====== precision ======
+// -DUSE_FLOAT で全体を単精度で計算する
+
+#ifdef USE_FLOAT
+typedef float real;
+#define REAL(x) x##f // floating literal of type real
+#define HIT_EPSILON 0.003f // minimum t of a hit, a little larger for the coarser float grid
+#define PRECISION_SUFFIX "_float"
+#else
+typedef double real;
+#define REAL(x) x
+#define HIT_EPSILON 0.001 // minimum t of a hit
+#define PRECISION_SUFFIX ""
+#endif
 
 // ====== randoms ======
+// 乱数列はサンプルごとに独立させる。(seed, frame, pixel, sample) をハッシュして
+// xor_shift の初期状態にするので、どのスレッドがどの順で描いても同じ結果になる。
+
+// integer hash with good avalanche (lowbias32)
+static inline unsigned int hash_u32(unsigned int x)
+{
+    x ^= x >> 16;
+    x *= 0x7feb352dU;
+    x ^= x >> 15;
+    x *= 0x846ca68bU;
+    x ^= x >> 16;
+    return x;
+}
+
+// initial state of the stream used by one sample of pixel (x, y)
+static inline unsigned int sample_seed(unsigned int seed, unsigned int frame, int x, int y, int sample)
+{
+    unsigned int h = hash_u32(seed ^ hash_u32(frame));
+    h = hash_u32(h ^ (unsigned int)x);
+    h = hash_u32(h ^ (unsigned int)y);
+    h = hash_u32(h ^ (unsigned int)sample);
+    return h != 0 ? h : 1; // xor_shift never leaves 0
+}
+
 static inline double xor_shift(unsigned int *state)
 {
     *state ^= *state << 13;
@@ -18,23 +57,29 @@ static inline double xor_shift(unsigned int *state)
 }
 
 // return [0, 1)
-static inline double rand_unit(unsigned int *state)
+static inline real rand_unit(unsigned int *state)
 {
+#ifdef USE_FLOAT
+    // top 24 bits so that the quotient never rounds up to 1
+    xor_shift(state);
+    return (*state >> 8) * (1.0f / 16777216.0f);
+#else
     return xor_shift(state) / (double)UINT_MAX;
+#endif
 }
 
-static inline double rand_range(unsigned int *state, double min, double max)
+static inline real rand_range(unsigned int *state, real min, real max)
 {
     return min + (max - min) * rand_unit(state);
 }
 
 // ====== utility ======
 
-static double schlick(double cosine, double ref_idx)
+static real schlick(real cosine, real ref_idx)
 {
-    double r0 = (1 - ref_idx) / (1 + ref_idx);
+    real r0 = (1 - ref_idx) / (1 + ref_idx);
     r0 = r0 * r0;
-    return r0 + (1 - r0) * pow((1 - cosine), 5);
+    return r0 + (1 - r0) * pow((1 - cosine), REAL(5.0));
 }
 
 // ====== time ======
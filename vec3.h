@@ -3,17 +3,18 @@
 
 #include <math.h>
 #include <assert.h>
+#include <stdbool.h>
 #include "utils.h"
 
 // ====== vector ======
 
-// type for 3 set of float
+// type for 3 set of float (double unless USE_FLOAT)
 typedef struct
 {
-    double x, y, z;
+    real x, y, z;
 } vec3;
 
-static inline vec3 vec3_make(double x, double y, double z)
+static inline vec3 vec3_make(real x, real y, real z)
 {
     vec3 v;
     v.x = x;
@@ -37,29 +38,29 @@ static inline vec3 vec3_sub(vec3 a, vec3 b)
     return vec3_make(a.x - b.x, a.y - b.y, a.z - b.z);
 }
 
-static inline vec3 vec3_scale(vec3 a, double s)
+static inline vec3 vec3_scale(vec3 a, real s)
 {
     return vec3_make(a.x * s, a.y * s, a.z * s);
 }
 
-static inline double vec3_dot(vec3 a, vec3 b)
+static inline real vec3_dot(vec3 a, vec3 b)
 {
     return a.x * b.x + a.y * b.y + a.z * b.z;
 }
 
-static inline double vec3_length(vec3 a)
+static inline real vec3_length(vec3 a)
 {
     return sqrt(vec3_dot(a, a));
 }
 
 static inline vec3 vec3_unit(vec3 a)
 {
-    double len = vec3_length(a);
-    if (len == 0.0)
+    real len = vec3_length(a);
+    if (len == REAL(0.0))
     {
         return vec3_make(0.0, 0.0, 0.0);
     }
-    return vec3_scale(a, 1.0 / len);
+    return vec3_scale(a, REAL(1.0) / len);
 }
 
 static inline vec3 vec3_cross(vec3 a, vec3 b)
@@ -69,9 +70,31 @@ static inline vec3 vec3_cross(vec3 a, vec3 b)
                      a.x * b.y - a.y * b.x);
 }
 
+// component by index, 0 for x, 1 for y, 2 for z
+static inline real vec3_axis(vec3 a, int axis)
+{
+    return axis == 0 ? a.x : axis == 1 ? a.y : a.z;
+}
+
+static inline vec3 vec3_min(vec3 a, vec3 b)
+{
+    return vec3_make(fmin(a.x, b.x), fmin(a.y, b.y), fmin(a.z, b.z));
+}
+
+static inline vec3 vec3_max(vec3 a, vec3 b)
+{
+    return vec3_make(fmax(a.x, b.x), fmax(a.y, b.y), fmax(a.z, b.z));
+}
+
+static inline real vec3_max_component(vec3 a)
+{
+    real m = a.x > a.y ? a.x : a.y;
+    return m > a.z ? m : a.z;
+}
+
 static inline vec3 vec3_reflect(vec3 v, vec3 n)
 {
-    return vec3_sub(v, vec3_scale(n, 2.0 * vec3_dot(v, n)));
+    return vec3_sub(v, vec3_scale(n, REAL(2.0) * vec3_dot(v, n)));
 }
 
 // // cos^3 phi なのでだめらしい
@@ -86,17 +109,17 @@ static inline vec3 vec3_reflect(vec3 v, vec3 n)
 
 static inline vec3 random_unit_vector(unsigned int *state)
 {
-    double a = rand_range(state, 0, 2 * MY_PI);
-    double z = rand_range(state, -1, 1);
-    double r = sqrt(1 - z * z);
+    real a = rand_range(state, 0, 2 * MY_PI);
+    real z = rand_range(state, -1, 1);
+    real r = sqrt(1 - z * z);
     return vec3_make(r * cos(a), r * sin(a), z);
 }
 
-static inline vec3 refract(vec3 uv, vec3 n, double etai_over_etat)
+static inline vec3 refract(vec3 uv, vec3 n, real etai_over_etat)
 {
-    double cos_theta = vec3_dot(vec3_inv(uv), n);
+    real cos_theta = vec3_dot(vec3_inv(uv), n);
     vec3 r_out_parallel = vec3_scale(vec3_add(uv, vec3_scale(n, cos_theta)), etai_over_etat);
-    vec3 r_out_perp = vec3_scale(n, -sqrt(1.0 - vec3_dot(r_out_parallel, r_out_parallel)));
+    vec3 r_out_perp = vec3_scale(n, -sqrt(REAL(1.0) - vec3_dot(r_out_parallel, r_out_parallel)));
     return vec3_add(r_out_perp, r_out_parallel);
 }
 
@@ -111,14 +134,14 @@ typedef struct
 
 static inline ray ray_make(point origin, vec3 direction)
 {
-    assert(vec3_length(direction) > 0.0);
+    assert(vec3_length(direction) > REAL(0.0));
     ray r;
     r.origin = origin;
     r.direction = direction;
     return r;
 }
 
-static inline point ray_at(ray r, double t)
+static inline point ray_at(ray r, real t)
 {
     return vec3_add(r.origin, vec3_scale(r.direction, t));
 }
@@ -128,26 +151,27 @@ static inline point ray_at(ray r, double t)
 // x for red, y for green, z for blue
 typedef vec3 color;
 
-static inline color color_make(double x, double y, double z)
+static inline color color_make(real x, real y, real z)
 {
-    assert(x >= 0.0 && x <= 1.0);
-    assert(y >= 0.0 && y <= 1.0);
-    assert(z >= 0.0 && z <= 1.0);
+    assert(x >= REAL(0.0) && x <= REAL(1.0));
+    assert(y >= REAL(0.0) && y <= REAL(1.0));
+    assert(z >= REAL(0.0) && z <= REAL(1.0));
     return vec3_make(x, y, z);
 }
 
 // a * (1 - t) + b * t
-static inline color color_mix(color a, color b, double t)
+static inline color color_mix(color a, color b, real t)
 {
-    assert(t >= 0.0 && t <= 1.0);
-    color at = vec3_scale(a, 1.0 - t);
+    assert(t >= REAL(0.0) && t <= REAL(1.0));
+    color at = vec3_scale(a, REAL(1.0) - t);
     color bt = vec3_scale(b, t);
     return vec3_add(at, bt);
 }
 
+// radiance can be above 1 once there are lights, so this does not check the range
 static inline color color_attenuation(color a, color b)
 {
-    return color_make(
+    return vec3_make(
         a.x * b.x,
         a.y * b.y,
         a.z * b.z);
@@ -156,27 +180,37 @@ static inline color color_attenuation(color a, color b)
 static inline color background_color(ray r)
 {
     vec3 unit_direction = vec3_unit(r.direction);
-    double t = 0.5 * (unit_direction.y + 1.0);
+    real t = REAL(0.5) * (unit_direction.y + REAL(1.0));
     return color_mix(
         color_make(1.0, 1.0, 1.0),
         color_make(0.5, 0.7, 1.0),
         t);
 }
 
+// [0, 1] -> [0, 255], out of range values are clamped
+static inline unsigned char color_byte(real c, bool gamma)
+{
+    if (!(c > REAL(0.0)))
+        return 0;
+    if (c >= REAL(1.0))
+        return 255;
+    return (unsigned char)(REAL(255.999) * (gamma ? sqrt(c) : c));
+}
+
 void write_color(FILE *f, color c)
 {
     fprintf(f, "%d %d %d\n",
-            (unsigned char)(255.999 * c.x),
-            (unsigned char)(255.999 * c.y),
-            (unsigned char)(255.999 * c.z));
+            color_byte(c.x, false),
+            color_byte(c.y, false),
+            color_byte(c.z, false));
 }
 
 void write_color_gamma(FILE *f, color c)
 {
     fprintf(f, "%d %d %d\n",
-            (unsigned char)(255.999 * sqrt(c.x)),
-            (unsigned char)(255.999 * sqrt(c.y)),
-            (unsigned char)(255.999 * sqrt(c.z)));
+            color_byte(c.x, true),
+            color_byte(c.y, true),
+            color_byte(c.z, true));
 }
 
 #endif
@@ -7,14 +7,25 @@
 #include <stdbool.h>
 #include "vec3.h"
 #include "component.h"
+#include "mesh.h"
+#include "transform.h"
+#include "arena.h"
 
 // ====== geometry ======
 
 typedef hit_record_geometry (*hit_func_fn)(void *geometry, ray ry);
+typedef bool (*occluded_func_fn)(void *geometry, ray ry, real t_max);
+typedef aabb (*bounds_func_fn)(void *geometry);
+typedef point (*sample_func_fn)(void *geometry, unsigned int *state, vec3 *normal);
+typedef real (*area_func_fn)(void *geometry);
 
 typedef struct
 {
     hit_func_fn hit_func;
+    occluded_func_fn occluded_func;
+    bounds_func_fn bounds_func;
+    sample_func_fn sample_func;
+    area_func_fn area_func;
     void *geometry;
 } geometry;
 
@@ -23,35 +34,156 @@ hit_record_geometry hit_geometry(geometry g, ray ry)
     return g.hit_func(g.geometry, ry);
 }
 
+// any hit closer than t_max, for shadow rays
+bool occluded_geometry(geometry g, ray ry, real t_max)
+{
+    return g.occluded_func(g.geometry, ry, t_max);
+}
+
+aabb bounds_geometry(geometry g)
+{
+    return g.bounds_func(g.geometry);
+}
+
+// uniform point on the surface of g, normal receives the surface normal facing the lit side
+point sample_geometry(geometry g, unsigned int *state, vec3 *normal)
+{
+    return g.sample_func(g.geometry, state, normal);
+}
+
+real area_geometry(geometry g)
+{
+    return g.area_func(g.geometry);
+}
+
+// the create functions below put every primitive and material of one kind in one arena,
+// so objects of a kind sit next to each other in the order the scene made them
+static arena GEOMETRY_ARENA[GEOMETRY_TYPE_NUM];
+static arena MATERIAL_ARENA[MATERIAL_TYPE_NUM];
+// the geometry handles of defines (definition_geometry in scene.h), shared by their instances
+static arena DEFINITION_ARENA;
+
 geometry create_sphere(sphere sph)
 {
-    sphere *sph_ptr = malloc(sizeof(sphere));
+    sphere *sph_ptr = ARENA_NEW(&GEOMETRY_ARENA[SPHERE], sphere);
     *sph_ptr = sph;
     geometry g;
     g.hit_func = (hit_func_fn)hit_sphere;
+    g.occluded_func = (occluded_func_fn)occluded_sphere;
+    g.bounds_func = (bounds_func_fn)bounds_sphere;
+    g.sample_func = (sample_func_fn)sample_sphere;
+    g.area_func = (area_func_fn)area_sphere;
     g.geometry = sph_ptr;
     return g;
 }
 
+// stored precomputed, see triangle_pre
 geometry create_triangle(triangle tri)
 {
-    triangle *tri_ptr = malloc(sizeof(triangle));
-    *tri_ptr = tri;
+    triangle_pre *tri_ptr = ARENA_NEW(&GEOMETRY_ARENA[TRIANGLE], triangle_pre);
+    *tri_ptr = triangle_precompute(tri);
     geometry g;
-    g.hit_func = (hit_func_fn)hit_triangle;
+    g.hit_func = (hit_func_fn)hit_triangle_pre;
+    g.occluded_func = (occluded_func_fn)occluded_triangle_pre;
+    g.bounds_func = (bounds_func_fn)bounds_triangle_pre;
+    g.sample_func = (sample_func_fn)sample_triangle_pre;
+    g.area_func = (area_func_fn)area_triangle_pre;
     g.geometry = tri_ptr;
     return g;
 }
 
+geometry create_mesh(mesh_ref ref)
+{
+    mesh_ref *ref_ptr = ARENA_NEW(&GEOMETRY_ARENA[MESH], mesh_ref);
+    *ref_ptr = ref;
+    geometry g;
+    g.hit_func = (hit_func_fn)hit_mesh;
+    g.occluded_func = (occluded_func_fn)occluded_mesh;
+    g.bounds_func = (bounds_func_fn)bounds_mesh;
+    g.sample_func = (sample_func_fn)sample_mesh;
+    g.area_func = (area_func_fn)area_mesh;
+    g.geometry = ref_ptr;
+    return g;
+}
+
+// shared geometry placed by an affine transform.
+// rays are moved into object space with an unnormalized direction, so t is the same in both spaces
+typedef struct
+{
+    affine to_world;
+    affine to_object;
+    real area_scale; // world area / object area, exact for rotation and uniform scale, parse.h allows no other on emissive instances
+    geometry base;
+} instance;
+
+static inline ray instance_ray(const instance *inst, ray ry)
+{
+    STATS_INC(STAT_INSTANCE_RAYS);
+    return ray_make(affine_point(&inst->to_object, ry.origin), affine_vector(&inst->to_object, ry.direction));
+}
+
+hit_record_geometry hit_instance(instance *inst, ray ry)
+{
+    hit_record_geometry rec = hit_geometry(inst->base, instance_ray(inst, ry));
+    if (rec.t >= REAL(0.0))
+    {
+        rec.r = ry;
+        rec.normal = affine_normal(&inst->to_object, rec.normal);
+    }
+    return rec;
+}
+
+bool occluded_instance(instance *inst, ray ry, real t_max)
+{
+    return occluded_geometry(inst->base, instance_ray(inst, ry), t_max);
+}
+
+aabb bounds_instance(instance *inst)
+{
+    return affine_bounds(&inst->to_world, bounds_geometry(inst->base));
+}
+
+point sample_instance(instance *inst, unsigned int *state, vec3 *normal)
+{
+    point p = sample_geometry(inst->base, state, normal);
+    *normal = affine_normal(&inst->to_object, *normal);
+    return affine_point(&inst->to_world, p);
+}
+
+real area_instance(instance *inst)
+{
+    return area_geometry(inst->base) * inst->area_scale;
+}
+
+// base is shared, only the transforms are allocated per instance
+geometry create_instance(geometry base, affine to_world)
+{
+    instance *inst = ARENA_NEW(&GEOMETRY_ARENA[INSTANCE], instance);
+    inst->to_world = to_world;
+    affine_inverse(&to_world, &inst->to_object);
+    inst->area_scale = pow(fabs(affine_det(&to_world)), 2.0 / 3.0);
+    inst->base = base;
+    geometry g;
+    g.hit_func = (hit_func_fn)hit_instance;
+    g.occluded_func = (occluded_func_fn)occluded_instance;
+    g.bounds_func = (bounds_func_fn)bounds_instance;
+    g.sample_func = (sample_func_fn)sample_instance;
+    g.area_func = (area_func_fn)area_instance;
+    g.geometry = inst;
+    return g;
+}
+
 // ====== materials ======
 
 typedef ray (*scatter_fn)(void *material, hit_record_geometry rec, unsigned int *state);
 typedef color (*color_transform_fn)(void *material, color col, unsigned int *state);
+typedef color (*emitted_fn)(void *material);
 
 typedef struct
 {
     scatter_fn scatter;
     color_transform_fn color_transform;
+    emitted_fn emitted; // NULL unless the material is a light
     void *data;
 } material;
 
@@ -65,14 +197,49 @@ color color_transform_material(material mat, color col, unsigned int *state)
     return mat.color_transform(mat.data, col, state);
 }
 
+// lights end the path instead of scattering it
+static inline bool is_emissive_material(material mat)
+{
+    return mat.emitted != NULL;
+}
+
+// materials that get direct light sampling
+static inline bool is_diffuse_material(material mat)
+{
+    return mat.scatter == (scatter_fn)scatter_lambertian;
+}
+
+// only the statistics need it, the renderer dispatches through the pointers
+static inline material_type material_type_of(material mat)
+{
+    if (mat.emitted)
+        return EMISSIVE;
+    if (mat.scatter == (scatter_fn)scatter_metal)
+        return METAL;
+    return mat.scatter == (scatter_fn)scatter_lambertian ? LAMBERTIAN : DIELECTRIC;
+}
+
+color emitted_material(material mat)
+{
+    return mat.emitted ? mat.emitted(mat.data) : vec3_make(0.0, 0.0, 0.0);
+}
+
+// lights emit on their front side only, the side sample_geometry gives the normal of,
+// so a light seen from behind is black with and without light sampling
+color emitted_hit(material mat, hit_record_geometry rec)
+{
+    return hit_from_outer(rec) ? emitted_material(mat) : vec3_make(0.0, 0.0, 0.0);
+}
+
 material metal_material(metal m)
 {
-    metal *m_ptr = malloc(sizeof(metal));
+    metal *m_ptr = ARENA_NEW(&MATERIAL_ARENA[METAL], metal);
     *m_ptr = m;
 
     material mat;
     mat.scatter = (scatter_fn)scatter_metal;
     mat.color_transform = (color_transform_fn)color_transform_metal;
+    mat.emitted = NULL;
     mat.data = m_ptr;
 
     return mat;
@@ -80,12 +247,13 @@ material metal_material(metal m)
 
 material lambertian_material(lambertian l)
 {
-    lambertian *l_ptr = malloc(sizeof(lambertian));
+    lambertian *l_ptr = ARENA_NEW(&MATERIAL_ARENA[LAMBERTIAN], lambertian);
     *l_ptr = l;
 
     material mat;
     mat.scatter = (scatter_fn)scatter_lambertian;
     mat.color_transform = (color_transform_fn)color_transform_lambertian;
+    mat.emitted = NULL;
     mat.data = l_ptr;
 
     return mat;
@@ -93,17 +261,33 @@ material lambertian_material(lambertian l)
 
 material dielectric_material(dielectric d)
 {
-    dielectric *d_ptr = malloc(sizeof(dielectric));
+    dielectric *d_ptr = ARENA_NEW(&MATERIAL_ARENA[DIELECTRIC], dielectric);
     *d_ptr = d;
 
     material mat;
     mat.scatter = (scatter_fn)scatter_dielectric;
     mat.color_transform = (color_transform_fn)color_transform_dielectric;
+    mat.emitted = NULL;
     mat.data = d_ptr;
 
     return mat;
 }
 
+material emissive_material(emissive e)
+{
+    emissive *e_ptr = ARENA_NEW(&MATERIAL_ARENA[EMISSIVE], emissive);
+    *e_ptr = e;
+
+    // never scattered or transformed, the path ends on a light
+    material mat;
+    mat.scatter = NULL;
+    mat.color_transform = NULL;
+    mat.emitted = (emitted_fn)emitted_emissive;
+    mat.data = e_ptr;
+
+    return mat;
+}
+
 // ====== entity ======
 typedef struct
 {
@@ -111,4 +295,18 @@ typedef struct
     material mat;
 } entity;
 
+// every geometry and material made by the create functions, the meshes stay in MESH_TABLE
+void free_world_entities(void)
+{
+    for (int i = 0; i < GEOMETRY_TYPE_NUM; ++i)
+    {
+        arena_free(&GEOMETRY_ARENA[i]);
+    }
+    for (int i = 0; i < MATERIAL_TYPE_NUM; ++i)
+    {
+        arena_free(&MATERIAL_ARENA[i]);
+    }
+    arena_free(&DEFINITION_ARENA);
+}
+
 #endif
\ No newline at end of file
@@ -7,19 +7,57 @@
 #include <stdbool.h>
 #include "vec3.h"
 #include "component.h"
+#include "mesh.h"
+#include "transform.h"
 
 // ====== geometry union ======
 
+struct geometry_union;
+
+// shared geometry placed by an affine transform.
+// rays are moved into object space with an unnormalized direction, so t is the same in both spaces
 typedef struct
+{
+    affine to_world;
+    affine to_object;
+    real area_scale; // world area / object area, exact for rotation and uniform scale, parse.h allows no other on emissive instances
+    const struct geometry_union *base;
+} instance;
+
+typedef struct geometry_union
 {
     geometry_type type;
     union
     {
         sphere s;
-        triangle t;
+        triangle_pre t;
+        mesh_ref m;
+        instance *i;
     } geometry;
 } geometry_union;
 
+instance *instance_make(const geometry_union *base, affine to_world)
+{
+    instance *inst = malloc(sizeof(instance));
+    inst->to_world = to_world;
+    affine_inverse(&to_world, &inst->to_object);
+    inst->area_scale = pow(fabs(affine_det(&to_world)), 2.0 / 3.0);
+    inst->base = base;
+    return inst;
+}
+
+static inline ray instance_ray(const instance *inst, ray ry)
+{
+    STATS_INC(STAT_INSTANCE_RAYS);
+    return ray_make(affine_point(&inst->to_object, ry.origin), affine_vector(&inst->to_object, ry.direction));
+}
+
+hit_record_geometry hit_instance(const instance *inst, ray ry);
+bool occluded_instance(const instance *inst, ray ry, real t_max);
+aabb bounds_instance(const instance *inst);
+point sample_instance(const instance *inst, unsigned int *state, vec3 *normal);
+real area_instance(const instance *inst);
+
 // ====== material union ======
 
 typedef struct
@@ -30,6 +68,7 @@ typedef struct
         metal m;
         lambertian l;
         dielectric d;
+        emissive e;
     } material;
 } material_union;
 
@@ -42,7 +81,13 @@ hit_record_geometry hit_geometry(geometry_union g, ray ry)
         rec = hit_sphere(&g.geometry.s, ry);
         break;
     case TRIANGLE:
-        rec = hit_triangle(&g.geometry.t, ry);
+        rec = hit_triangle_pre(&g.geometry.t, ry);
+        break;
+    case MESH:
+        rec = hit_mesh(&g.geometry.m, ry);
+        break;
+    case INSTANCE:
+        rec = hit_instance(g.geometry.i, ry);
         break;
     default:
         rec.t = -1.0;
@@ -51,12 +96,117 @@ hit_record_geometry hit_geometry(geometry_union g, ray ry)
     return rec;
 }
 
+// any hit closer than t_max, for shadow rays
+bool occluded_geometry(geometry_union g, ray ry, real t_max)
+{
+    switch (g.type)
+    {
+    case SPHERE:
+        return occluded_sphere(&g.geometry.s, ry, t_max);
+    case TRIANGLE:
+        return occluded_triangle_pre(&g.geometry.t, ry, t_max);
+    case MESH:
+        return occluded_mesh(&g.geometry.m, ry, t_max);
+    case INSTANCE:
+        return occluded_instance(g.geometry.i, ry, t_max);
+    default:
+        return false;
+    }
+}
+
+aabb bounds_geometry(geometry_union g)
+{
+    switch (g.type)
+    {
+    case SPHERE:
+        return bounds_sphere(&g.geometry.s);
+    case TRIANGLE:
+        return bounds_triangle_pre(&g.geometry.t);
+    case MESH:
+        return bounds_mesh(&g.geometry.m);
+    case INSTANCE:
+        return bounds_instance(g.geometry.i);
+    default:
+        return aabb_empty();
+    }
+}
+
+// uniform point on the surface of g, normal receives the surface normal facing the lit side
+point sample_geometry(geometry_union g, unsigned int *state, vec3 *normal)
+{
+    switch (g.type)
+    {
+    case SPHERE:
+        return sample_sphere(&g.geometry.s, state, normal);
+    case TRIANGLE:
+        return sample_triangle_pre(&g.geometry.t, state, normal);
+    case MESH:
+        return sample_mesh(&g.geometry.m, state, normal);
+    case INSTANCE:
+        return sample_instance(g.geometry.i, state, normal);
+    default:
+        *normal = vec3_make(0.0, 0.0, 1.0);
+        return vec3_make(0.0, 0.0, 0.0);
+    }
+}
+
+real area_geometry(geometry_union g)
+{
+    switch (g.type)
+    {
+    case SPHERE:
+        return area_sphere(&g.geometry.s);
+    case TRIANGLE:
+        return area_triangle_pre(&g.geometry.t);
+    case MESH:
+        return area_mesh(&g.geometry.m);
+    case INSTANCE:
+        return area_instance(g.geometry.i);
+    default:
+        return 0.0;
+    }
+}
+
+hit_record_geometry hit_instance(const instance *inst, ray ry)
+{
+    hit_record_geometry rec = hit_geometry(*inst->base, instance_ray(inst, ry));
+    if (rec.t >= REAL(0.0))
+    {
+        rec.r = ry;
+        rec.normal = affine_normal(&inst->to_object, rec.normal);
+    }
+    return rec;
+}
+
+bool occluded_instance(const instance *inst, ray ry, real t_max)
+{
+    return occluded_geometry(*inst->base, instance_ray(inst, ry), t_max);
+}
+
+aabb bounds_instance(const instance *inst)
+{
+    return affine_bounds(&inst->to_world, bounds_geometry(*inst->base));
+}
+
+point sample_instance(const instance *inst, unsigned int *state, vec3 *normal)
+{
+    point p = sample_geometry(*inst->base, state, normal);
+    *normal = affine_normal(&inst->to_object, *normal);
+    return affine_point(&inst->to_world, p);
+}
+
+real area_instance(const instance *inst)
+{
+    return area_geometry(*inst->base) * inst->area_scale;
+}
+
 // ====== entity ======
 
+// intersection walks only the geometry, the material is looked up once per bounce for the winning hit
 typedef struct
 {
     geometry_union geo;
-    material_union mat;
+    uint32_t material; // index into MATERIAL (scene_comb.h)
 } entity;
 
 ray scatter_material(material_union mu, hit_record_geometry rec, unsigned int *state)
@@ -74,6 +224,35 @@ ray scatter_material(material_union mu, hit_record_geometry rec, unsigned int *s
     }
 }
 
+// lights end the path instead of scattering it
+static inline bool is_emissive_material(material_union mu)
+{
+    return mu.type == EMISSIVE;
+}
+
+// materials that get direct light sampling
+static inline bool is_diffuse_material(material_union mu)
+{
+    return mu.type == LAMBERTIAN;
+}
+
+static inline material_type material_type_of(material_union mu)
+{
+    return mu.type;
+}
+
+color emitted_material(material_union mu)
+{
+    return mu.type == EMISSIVE ? emitted_emissive(&mu.material.e) : vec3_make(0.0, 0.0, 0.0);
+}
+
+// lights emit on their front side only, the side sample_geometry gives the normal of,
+// so a light seen from behind is black with and without light sampling
+color emitted_hit(material_union mu, hit_record_geometry rec)
+{
+    return hit_from_outer(rec) ? emitted_material(mu) : vec3_make(0.0, 0.0, 0.0);
+}
+
 color color_transform_material(material_union mu, color col, unsigned int *state)
 {
     switch (mu.type)
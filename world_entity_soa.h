@@ -0,0 +1,344 @@
+#ifndef WORLD_ENTITY_SOA_H
+#define WORLD_ENTITY_SOA_H
+
+// world_entity_comb.h の entity を、種類ごとに成分を別々の配列にして持ち直す (structure of arrays)。
+// BVH の葉ごとに球と三角形の範囲を覚えておき、葉の中は SIMD で SIMD_WIDTH 個ずつ判定する。
+// それ以外の entity (メッシュ) は葉ごとの一覧に入れておき、hit_geometry でひとつずつ判定する。
+// USE_SIMD を定義してビルドしたときだけ scene_comb.h から使われる。
+
+#include <stdint.h>
+#include "world_entity_comb.h"
+#include "bvh.h"
+#include "simd.h"
+
+typedef struct
+{
+    // spheres
+    size_t sphere_num;
+    real *cx, *cy, *cz, *radius;
+    uint32_t *sphere_entity;
+
+    // triangles, stored as a vertex and the two edges from it
+    size_t triangle_num;
+    real *ax, *ay, *az;
+    real *abx, *aby, *abz;
+    real *acx, *acy, *acz;
+    uint32_t *triangle_entity;
+
+    // other entities, tested one by one
+    const entity *ents;
+    size_t other_num;
+    uint32_t *other_entity;
+
+    // range of each leaf, indexed by bvh node
+    uint32_t *leaf_sphere_first, *leaf_sphere_count;
+    uint32_t *leaf_triangle_first, *leaf_triangle_count;
+    uint32_t *leaf_other_first, *leaf_other_count;
+} soa_store;
+
+// padded by SIMD_WIDTH so that the last load of a leaf stays inside the array
+static real *soa_alloc(size_t n)
+{
+    return calloc(n + SIMD_WIDTH, sizeof(real));
+}
+
+void soa_build(soa_store *s, const bvh *b, const entity *ents, size_t entity_num)
+{
+    s->sphere_num = 0;
+    s->triangle_num = 0;
+    s->other_num = 0;
+    for (size_t i = 0; i < entity_num; ++i)
+    {
+        if (ents[i].geo.type == SPHERE)
+            s->sphere_num++;
+        else if (ents[i].geo.type == TRIANGLE)
+            s->triangle_num++;
+        else
+            s->other_num++;
+    }
+
+    s->cx = soa_alloc(s->sphere_num);
+    s->cy = soa_alloc(s->sphere_num);
+    s->cz = soa_alloc(s->sphere_num);
+    s->radius = soa_alloc(s->sphere_num);
+    s->sphere_entity = calloc(s->sphere_num + 1, sizeof(uint32_t));
+
+    s->ax = soa_alloc(s->triangle_num);
+    s->ay = soa_alloc(s->triangle_num);
+    s->az = soa_alloc(s->triangle_num);
+    s->abx = soa_alloc(s->triangle_num);
+    s->aby = soa_alloc(s->triangle_num);
+    s->abz = soa_alloc(s->triangle_num);
+    s->acx = soa_alloc(s->triangle_num);
+    s->acy = soa_alloc(s->triangle_num);
+    s->acz = soa_alloc(s->triangle_num);
+    s->triangle_entity = calloc(s->triangle_num + 1, sizeof(uint32_t));
+
+    s->ents = ents;
+    s->other_entity = calloc(s->other_num + 1, sizeof(uint32_t));
+
+    s->leaf_sphere_first = calloc(b->node_num, sizeof(uint32_t));
+    s->leaf_sphere_count = calloc(b->node_num, sizeof(uint32_t));
+    s->leaf_triangle_first = calloc(b->node_num, sizeof(uint32_t));
+    s->leaf_triangle_count = calloc(b->node_num, sizeof(uint32_t));
+    s->leaf_other_first = calloc(b->node_num, sizeof(uint32_t));
+    s->leaf_other_count = calloc(b->node_num, sizeof(uint32_t));
+
+    size_t sphere_i = 0;
+    size_t triangle_i = 0;
+    size_t other_i = 0;
+    for (size_t n = 0; n < b->node_num; ++n)
+    {
+        const bvh_node *node = &b->nodes[n];
+        if (!bvh_is_leaf(node))
+            continue;
+
+        s->leaf_sphere_first[n] = sphere_i;
+        s->leaf_triangle_first[n] = triangle_i;
+        s->leaf_other_first[n] = other_i;
+        for (size_t i = node->left_first; i < node->left_first + node->count; ++i)
+        {
+            const geometry_union *g = &ents[i].geo;
+            if (g->type == SPHERE)
+            {
+                s->cx[sphere_i] = g->geometry.s.center.x;
+                s->cy[sphere_i] = g->geometry.s.center.y;
+                s->cz[sphere_i] = g->geometry.s.center.z;
+                s->radius[sphere_i] = g->geometry.s.radius;
+                s->sphere_entity[sphere_i] = i;
+                sphere_i++;
+            }
+            else if (g->type == TRIANGLE)
+            {
+                const triangle_pre *t = &g->geometry.t;
+                vec3 ab = t->ab;
+                vec3 ac = t->ac;
+                s->ax[triangle_i] = t->a.x;
+                s->ay[triangle_i] = t->a.y;
+                s->az[triangle_i] = t->a.z;
+                s->abx[triangle_i] = ab.x;
+                s->aby[triangle_i] = ab.y;
+                s->abz[triangle_i] = ab.z;
+                s->acx[triangle_i] = ac.x;
+                s->acy[triangle_i] = ac.y;
+                s->acz[triangle_i] = ac.z;
+                s->triangle_entity[triangle_i] = i;
+                triangle_i++;
+            }
+            else
+            {
+                s->other_entity[other_i++] = i;
+            }
+        }
+        s->leaf_sphere_count[n] = sphere_i - s->leaf_sphere_first[n];
+        s->leaf_triangle_count[n] = triangle_i - s->leaf_triangle_first[n];
+        s->leaf_other_count[n] = other_i - s->leaf_other_first[n];
+    }
+}
+
+// ====== kernels ======
+// same arithmetic as hit_sphere / hit_triangle_pre, the early returns become lane masks.
+
+// lanes in `mask` whose t is below *t_best update it, return the winning entity or BVH_NO_HIT
+static inline size_t soa_pick_closest(simd_real mask, simd_real t, const uint32_t *entity_of, real *t_best)
+{
+    size_t hit_index = BVH_NO_HIT;
+    int bits = simd_movemask(mask);
+    if (bits == 0)
+        return hit_index;
+
+    real ts[SIMD_WIDTH];
+    simd_store(ts, t);
+    for (int k = 0; k < SIMD_WIDTH; ++k)
+    {
+        if ((bits >> k) & 1 && ts[k] < *t_best)
+        {
+            *t_best = ts[k];
+            hit_index = entity_of[k];
+        }
+    }
+    return hit_index;
+}
+
+static inline size_t soa_hit_spheres(const soa_store *s, size_t first, size_t count, ray r, real *t_best)
+{
+    size_t hit_index = BVH_NO_HIT;
+    STATS_ADD(STAT_SPHERE_TESTS, count);
+
+    simd_real ox = simd_set1(r.origin.x);
+    simd_real oy = simd_set1(r.origin.y);
+    simd_real oz = simd_set1(r.origin.z);
+    simd_real dx = simd_set1(r.direction.x);
+    simd_real dy = simd_set1(r.direction.y);
+    simd_real dz = simd_set1(r.direction.z);
+
+    real a_scalar = vec3_dot(r.direction, r.direction);
+    simd_real a4 = simd_set1(4 * a_scalar);
+    simd_real a2 = simd_set1(REAL(2.0) * a_scalar);
+    simd_real two = simd_set1(2.0);
+    simd_real zero = simd_set1(0.0);
+    simd_real t_eps = simd_set1(HIT_EPSILON);
+
+    for (size_t i = 0; i < count; i += SIMD_WIDTH)
+    {
+        size_t j = first + i;
+        simd_real ocx = simd_sub(ox, simd_load(s->cx + j));
+        simd_real ocy = simd_sub(oy, simd_load(s->cy + j));
+        simd_real ocz = simd_sub(oz, simd_load(s->cz + j));
+        simd_real rad = simd_load(s->radius + j);
+
+        simd_real b = simd_mul(two, simd_add(simd_add(simd_mul(ocx, dx), simd_mul(ocy, dy)), simd_mul(ocz, dz)));
+        simd_real c = simd_sub(simd_add(simd_add(simd_mul(ocx, ocx), simd_mul(ocy, ocy)), simd_mul(ocz, ocz)),
+                               simd_mul(rad, rad));
+        simd_real discriminant = simd_sub(simd_mul(b, b), simd_mul(a4, c));
+        simd_real t = simd_div(simd_sub(simd_sub(zero, b), simd_sqrt(discriminant)), a2);
+
+        simd_real mask = simd_first_lanes(count - i);
+        mask = simd_and(mask, simd_ge(discriminant, zero));
+        mask = simd_and(mask, simd_ge(t, t_eps));
+        mask = simd_and(mask, simd_lt(t, simd_set1(*t_best)));
+
+        size_t hit = soa_pick_closest(mask, t, s->sphere_entity + j, t_best);
+        if (hit != BVH_NO_HIT)
+            hit_index = hit;
+    }
+    return hit_index;
+}
+
+static inline size_t soa_hit_triangles(const soa_store *s, size_t first, size_t count, ray r, real *t_best)
+{
+    size_t hit_index = BVH_NO_HIT;
+    STATS_ADD(STAT_TRIANGLE_TESTS, count);
+
+    simd_real ox = simd_set1(r.origin.x);
+    simd_real oy = simd_set1(r.origin.y);
+    simd_real oz = simd_set1(r.origin.z);
+    simd_real dx = simd_set1(r.direction.x);
+    simd_real dy = simd_set1(r.direction.y);
+    simd_real dz = simd_set1(r.direction.z);
+
+    simd_real zero = simd_set1(0.0);
+    simd_real one = simd_set1(1.0);
+    simd_real det_eps = simd_set1(TRIANGLE_DET_EPSILON);
+    simd_real t_eps = simd_set1(HIT_EPSILON);
+
+    for (size_t i = 0; i < count; i += SIMD_WIDTH)
+    {
+        size_t j = first + i;
+        simd_real abx = simd_load(s->abx + j);
+        simd_real aby = simd_load(s->aby + j);
+        simd_real abz = simd_load(s->abz + j);
+        simd_real acx = simd_load(s->acx + j);
+        simd_real acy = simd_load(s->acy + j);
+        simd_real acz = simd_load(s->acz + j);
+
+        // pvec = direction x ac
+        simd_real px = simd_sub(simd_mul(dy, acz), simd_mul(dz, acy));
+        simd_real py = simd_sub(simd_mul(dz, acx), simd_mul(dx, acz));
+        simd_real pz = simd_sub(simd_mul(dx, acy), simd_mul(dy, acx));
+        simd_real det = simd_add(simd_add(simd_mul(abx, px), simd_mul(aby, py)), simd_mul(abz, pz));
+        simd_real inv_det = simd_div(one, det);
+
+        simd_real tx = simd_sub(ox, simd_load(s->ax + j));
+        simd_real ty = simd_sub(oy, simd_load(s->ay + j));
+        simd_real tz = simd_sub(oz, simd_load(s->az + j));
+        simd_real u = simd_mul(inv_det, simd_add(simd_add(simd_mul(tx, px), simd_mul(ty, py)), simd_mul(tz, pz)));
+
+        // qvec = tvec x ab
+        simd_real qx = simd_sub(simd_mul(ty, abz), simd_mul(tz, aby));
+        simd_real qy = simd_sub(simd_mul(tz, abx), simd_mul(tx, abz));
+        simd_real qz = simd_sub(simd_mul(tx, aby), simd_mul(ty, abx));
+        simd_real v = simd_mul(inv_det, simd_add(simd_add(simd_mul(dx, qx), simd_mul(dy, qy)), simd_mul(dz, qz)));
+        simd_real t = simd_mul(inv_det, simd_add(simd_add(simd_mul(acx, qx), simd_mul(acy, qy)), simd_mul(acz, qz)));
+
+        simd_real mask = simd_first_lanes(count - i);
+        mask = simd_and(mask, simd_ge(det, det_eps));
+        mask = simd_and(mask, simd_and(simd_ge(u, zero), simd_le(u, one)));
+        mask = simd_and(mask, simd_and(simd_ge(v, zero), simd_le(simd_add(u, v), one)));
+        mask = simd_and(mask, simd_ge(t, t_eps));
+        mask = simd_and(mask, simd_lt(t, simd_set1(*t_best)));
+
+        size_t hit = soa_pick_closest(mask, t, s->triangle_entity + j, t_best);
+        if (hit != BVH_NO_HIT)
+            hit_index = hit;
+    }
+    return hit_index;
+}
+
+// leaf callback for bvh_closest_hit
+// only closest->t is updated for spheres and triangles, the caller rebuilds their record
+// (see soa_full_record and soa_record); other entities leave their full record in closest
+static size_t soa_hit_leaf(const void *ctx, const bvh_node *leaf, size_t node_index,
+                           ray r, hit_record_geometry *closest)
+{
+    const soa_store *s = ctx;
+    real t_best = closest->t < REAL(0.0) ? INFINITY : closest->t;
+
+    size_t hit_index = soa_hit_spheres(s, s->leaf_sphere_first[node_index], s->leaf_sphere_count[node_index], r, &t_best);
+    size_t hit = soa_hit_triangles(s, s->leaf_triangle_first[node_index], s->leaf_triangle_count[node_index], r, &t_best);
+    if (hit != BVH_NO_HIT)
+        hit_index = hit;
+
+    if (hit_index != BVH_NO_HIT)
+        closest->t = t_best;
+
+    const uint32_t *other = s->other_entity + s->leaf_other_first[node_index];
+    for (size_t k = 0; k < s->leaf_other_count[node_index]; ++k)
+    {
+        hit_record_geometry rec = hit_geometry(s->ents[other[k]].geo, r);
+        if (rec.t >= REAL(0.0) && rec.t < t_best)
+        {
+            t_best = rec.t;
+            *closest = rec;
+            hit_index = other[k];
+        }
+    }
+    return hit_index;
+}
+
+// the winner of soa_hit_leaf already has its full record
+static inline bool soa_full_record(const soa_store *s, size_t hit_index)
+{
+    geometry_type type = s->ents[hit_index].geo.type;
+    return type != SPHERE && type != TRIANGLE;
+}
+
+// full record of a sphere or triangle winner found at t by the kernels
+// the scalar test is redone so that the record matches the scalar build, but its rounding differs
+// from the kernels and it can miss a hit the kernels found at an edge, then the record is made at t
+static inline hit_record_geometry soa_record(const soa_store *s, size_t hit_index, ray r, real t)
+{
+    geometry_union g = s->ents[hit_index].geo;
+    hit_record_geometry rec = hit_geometry(g, r);
+    if (rec.t >= HIT_EPSILON)
+        return rec;
+
+    rec.t = t;
+    rec.r = r;
+    if (g.type == SPHERE)
+        rec.normal = vec3_unit(vec3_sub(ray_at(r, t), g.geometry.s.center));
+    else
+        rec.normal = g.geometry.t.normal;
+    return rec;
+}
+
+// any-hit version of soa_hit_leaf for shadow rays
+static bool soa_occluded_leaf(const void *ctx, const bvh_node *leaf, size_t node_index,
+                              ray r, real t_max)
+{
+    const soa_store *s = ctx;
+    real t_best = t_max;
+    if (soa_hit_spheres(s, s->leaf_sphere_first[node_index], s->leaf_sphere_count[node_index], r, &t_best) != BVH_NO_HIT ||
+        soa_hit_triangles(s, s->leaf_triangle_first[node_index], s->leaf_triangle_count[node_index], r, &t_best) != BVH_NO_HIT)
+        return true;
+
+    const uint32_t *other = s->other_entity + s->leaf_other_first[node_index];
+    for (size_t k = 0; k < s->leaf_other_count[node_index]; ++k)
+    {
+        if (occluded_geometry(s->ents[other[k]].geo, r, t_max))
+            return true;
+    }
+    return false;
+}
+
+#endif